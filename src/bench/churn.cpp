@@ -0,0 +1,320 @@
+#include "../includes/clock.hpp"
+#include "../includes/config.hpp"
+#include "../includes/logger.hpp"
+#include "../includes/metrics.hpp"
+#include "../includes/nodes_manager.hpp"
+#include "pipewire/loop.h"
+#include "pipewire/pipewire.h"
+#include "sim_backend.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <malloc.h>
+#include <new>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+using std::string;
+using std::vector;
+
+// pipetron-churn, the node lifecycle against SimBackend. prints throughput and what is left in the record pool and id
+// table after each scenario, and fails if anything outlives the onodes it was created for
+
+const uint32_t STREAMS = 1000;
+const uint32_t ROUNDS = 5;
+const uint32_t APPS = 50;
+const uint32_t STORM_EVENTS = 10000;
+const char *MEDIA_CLASS = "Stream/Output/Audio";
+// less than one of the smallest allocations per stream, so a leak of anything kept per onode shows
+const int64_t HEAP_SLACK = STREAMS * 16;
+
+uint32_t remote = 0;
+uint32_t next_node_id = 100;
+uint32_t replicas_seen = 0;
+bool failed = false;
+
+// bytes allocated through new and not freed yet, counted by what malloc actually handed out. memory pipewire allocates
+// with malloc isn't in here, max_rss_kb covers it
+std::atomic<int64_t> heap_bytes = 0;
+
+void *operator new(size_t size) {
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+
+    heap_bytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed);
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    if (!ptr)
+        return;
+
+    heap_bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept {
+    operator delete(ptr);
+}
+
+struct usage {
+    NodesManager::stats stats;
+    int64_t heap_bytes;
+    long max_rss_kb;
+};
+
+void check(bool condition, const char *what) {
+    if (condition)
+        return;
+
+    printf("FAIL: %s\n", what);
+    failed = true;
+}
+
+double per_second(uint64_t count, uint64_t elapsed_ns) {
+    return elapsed_ns ? count * 1e9 / elapsed_ns : 0;
+}
+
+// the same filtering as Pipetron::on_registry_global without the rules, every onode is replicated
+void on_registry_global(void *data, uint32_t id, uint32_t permissions, const char *type, uint32_t version,
+                        const struct spa_dict *props) {
+    if (strcmp(type, PW_TYPE_INTERFACE_Node) != 0)
+        return;
+
+    if (NodesManager::is_replica(props)) {
+        replicas_seen++;
+        return;
+    }
+
+    NodesManager::process_new_node(remote, SimBackend::registry(), id, type, props);
+}
+
+void on_registry_global_remove(void *data, uint32_t id) {
+    NodesManager::on_global_remove(remote, id);
+}
+
+string app_of(uint32_t id, const char *prefix) {
+    return prefix + std::to_string(id % APPS);
+}
+
+vector<uint32_t> add_streams(uint32_t count, const char *prefix = "app-", bool negotiated = true) {
+    vector<uint32_t> ids = {};
+
+    for (uint32_t i = 0; i < count; i++) {
+        SimBackend::add_node(next_node_id, app_of(next_node_id, prefix), MEDIA_CLASS, negotiated);
+        ids.push_back(next_node_id++);
+    }
+
+    return ids;
+}
+
+void remove_streams(const vector<uint32_t> &ids) {
+    for (uint32_t id : ids)
+        SimBackend::remove_node(id);
+}
+
+usage measure() {
+    struct rusage self = {};
+    getrusage(RUSAGE_SELF, &self);
+
+    return {NodesManager::get_stats(), heap_bytes.load(std::memory_order_relaxed), self.ru_maxrss};
+}
+
+void print_usage(const char *when, const usage &current) {
+    const NodesManager::stats &stats = current.stats;
+    printf("  %-10s records %u, ids %u, vnodes %u (%u parked), heap %.1f kB, max rss %ld kB\n", when, stats.records,
+           stats.indexed, stats.vnodes, stats.parked, current.heap_bytes / 1024.0, current.max_rss_kb);
+}
+
+// a round that frees everything it allocated leaves the heap where it found it, once the maps have grown to size
+bool heap_settled(const usage &before, const usage &after) {
+    return after.heap_bytes - before.heap_bytes <= HEAP_SLACK;
+}
+
+// every round adds STREAMS onodes, replicates them and removes them again. the first one comes in the registry's
+// startup burst, later ones take over the vnodes parked by the round before
+void churn(struct pw_loop *loop) {
+    printf("churn: %u rounds of %u streams from %u apps\n", ROUNDS, STREAMS, APPS);
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        usage before = measure();
+        uint64_t begin_ns = monotonic_ns();
+        vector<uint32_t> ids = add_streams(STREAMS);
+
+        if (round == 0) {
+            SimBackend::pump(loop);
+            NodesManager::on_registry_synced(remote, false);
+        }
+
+        SimBackend::pump(loop);
+        uint64_t setup_ns = monotonic_ns() - begin_ns;
+
+        usage peak = measure();
+        check(peak.stats.records == STREAMS && peak.stats.indexed == STREAMS, "every onode has a record");
+        check(peak.stats.vnodes - peak.stats.parked == STREAMS, "every onode has a vnode");
+
+        begin_ns = monotonic_ns();
+        remove_streams(ids);
+        SimBackend::pump(loop);
+        uint64_t teardown_ns = monotonic_ns() - begin_ns;
+
+        printf("  round %u: up in %.1f ms (%.0f streams/s), down in %.1f ms (%.0f streams/s)\n", round + 1,
+               setup_ns / 1e6, per_second(STREAMS, setup_ns), teardown_ns / 1e6, per_second(STREAMS, teardown_ns));
+        usage after = measure();
+        print_usage("before", before);
+        print_usage("peak", peak);
+        print_usage("after", after);
+        check(after.stats.records == 0 && after.stats.indexed == 0, "no record outlives its onode");
+
+        // the first rounds grow the maps to size and leave their vnodes parked
+        if (round > 1)
+            check(heap_settled(before, after), "a round gives back the memory it took");
+    }
+}
+
+// every change differs from the last one on its vnode, so each one is written to its onode and echoed back
+void props_storm(struct pw_loop *loop) {
+    printf("props storm: %u vnode Props events over %u streams\n", STORM_EVENTS, STREAMS);
+
+    usage before = measure();
+    vector<uint32_t> ids = add_streams(STREAMS);
+    SimBackend::pump(loop);
+
+    vector<uint32_t> vnodes = SimBackend::stream_ids();
+    check(vnodes.size() == STREAMS, "the storm has one vnode per stream");
+    uint64_t writes = Metrics::get(Metrics::PROPS_WRITES);
+    uint64_t echoes = Metrics::get(Metrics::ECHOES_IGNORED);
+    uint64_t delivered = SimBackend::delivered_events();
+    uint64_t begin_ns = monotonic_ns();
+
+    for (uint32_t i = 0; i < STORM_EVENTS; i++) {
+        SimBackend::set_stream_volume(vnodes[i % vnodes.size()], (float)(i / vnodes.size() + 1) / 64);
+
+        // let the echoes of a burst come back before the next one, as the socket would
+        if ((i + 1) % 100 == 0)
+            SimBackend::pump(loop);
+    }
+
+    SimBackend::pump(loop);
+    uint64_t elapsed_ns = monotonic_ns() - begin_ns;
+
+    writes = Metrics::get(Metrics::PROPS_WRITES) - writes;
+    echoes = Metrics::get(Metrics::ECHOES_IGNORED) - echoes;
+    delivered = SimBackend::delivered_events() - delivered;
+
+    printf("  %.1f ms (%.0f events/s), %llu onode writes, %llu echoes recognised, %llu daemon events\n",
+           elapsed_ns / 1e6, per_second(STORM_EVENTS, elapsed_ns), (unsigned long long)writes,
+           (unsigned long long)echoes, (unsigned long long)delivered);
+    print_usage("before", before);
+    print_usage("during", measure());
+    check(writes == STORM_EVENTS, "every vnode change is written to its onode");
+    check(echoes == STORM_EVENTS, "every write is recognised when it is echoed");
+
+    remove_streams(ids);
+    SimBackend::pump(loop);
+
+    usage after = measure();
+    print_usage("after", after);
+    check(heap_settled(before, after), "the storm leaves nothing behind once its streams are gone");
+}
+
+// onodes removed at each stage of their setup and replaced under the same ids, without parking so every onode
+// creates a vnode stream of its own
+void setup_race(struct pw_loop *loop) {
+    printf("setup race: %u streams removed and replaced at each setup stage\n", STREAMS);
+    Config::vnode_grace_period_ms = 0;
+
+    const SimBackend::stage stages[] = {SimBackend::BOUND, SimBackend::INFO, SimBackend::FORMAT, SimBackend::SYNCING};
+    const char *names[] = {"bound", "with info", "with format", "syncing"};
+
+    for (uint32_t stage = 0; stage < 4; stage++) {
+        uint32_t removed = SimBackend::removals_at(stages[stage]);
+        usage before = measure();
+        uint64_t begin_ns = monotonic_ns();
+        vector<uint32_t> ids = add_streams(STREAMS, "race-", false);
+
+        // globals, then info, then Format once the streams are linked
+        for (uint32_t round = 0; round < stage; round++) {
+            SimBackend::deliver_round();
+
+            if (round == 1) {
+                for (uint32_t id : ids)
+                    SimBackend::negotiate(id);
+            }
+        }
+
+        remove_streams(ids);
+        for (uint32_t id : ids)
+            SimBackend::add_node(id, app_of(id, "race-"), MEDIA_CLASS);
+
+        SimBackend::pump(loop);
+        uint64_t elapsed_ns = monotonic_ns() - begin_ns;
+        removed = SimBackend::removals_at(stages[stage]) - removed;
+
+        usage replaced = measure();
+        printf("  removed %-11s %u of %u there, replaced in %.1f ms (%.0f streams/s)\n", names[stage], removed,
+               STREAMS, elapsed_ns / 1e6, per_second(STREAMS, elapsed_ns));
+        print_usage("replaced", replaced);
+        check(removed == STREAMS, "every removal reaches the onode at the stage it was aimed at");
+        check(replaced.stats.records == STREAMS && replaced.stats.indexed == STREAMS, "every replacement has a record");
+        check(replaced.stats.vnodes - replaced.stats.parked == STREAMS, "every replacement has a vnode");
+
+        remove_streams(ids);
+        SimBackend::pump(loop);
+
+        usage after = measure();
+        print_usage("after", after);
+        check(after.stats.records == 0 && after.stats.indexed == 0, "no record outlives a removal racing its setup");
+        if (stage > 0)
+            check(heap_settled(before, after), "nothing of the removed or replaced onodes is left on the heap");
+    }
+}
+
+int main(int argc, char **argv) {
+    pw_init(nullptr, nullptr);
+    Logger::start();
+    Logger::set_level(log_level::WARNING);
+
+    // the lifecycle on its own: no sync thread, cache, socket or app name lookups, and Props written as they come
+    Config::sync_thread = false;
+    Config::volume_cache = false;
+    Config::metrics_socket = false;
+    Config::resolve_app_names = false;
+    Config::props_max_rate_hz = 0;
+
+    struct pw_loop *loop = pw_loop_new(nullptr);
+    pw_loop_enter(loop);
+
+    SimBackend::start();
+    NodesManager::init(loop, false);
+    remote = NodesManager::add_remote("");
+
+    static const struct pw_registry_events registry_events = {
+        .version = PW_VERSION_REGISTRY_EVENTS,
+        .global = on_registry_global,
+        .global_remove = on_registry_global_remove,
+    };
+
+    struct spa_hook registry_listener = {};
+    SimBackend::add_registry_listener(&registry_listener, &registry_events, nullptr);
+
+    churn(loop);
+    props_storm(loop);
+    setup_race(loop);
+
+    NodesManager::cleanup();
+    spa_hook_remove(&registry_listener);
+
+    printf("cleanup: %u proxies, %u streams and %u app connections left, %u replica globals skipped\n",
+           SimBackend::live_proxies(), SimBackend::live_streams(), SimBackend::live_cores(), replicas_seen);
+    check(SimBackend::live_proxies() == 0 && SimBackend::live_streams() == 0 && SimBackend::live_cores() == 0,
+          "cleanup destroys everything it created");
+
+    pw_loop_leave(loop);
+    pw_loop_destroy(loop);
+    Logger::stop();
+
+    return failed ? 1 : 0;
+}
\ No newline at end of file
@@ -0,0 +1,546 @@
+#pragma once
+
+#include "../includes/backend.hpp"
+#include "../includes/props_state.hpp"
+#include "pipewire/keys.h"
+#include "pipewire/node.h"
+#include "pipewire/properties.h"
+#include "pipewire/stream.h"
+#include "spa/param/param.h"
+#include "spa/pod/builder.h"
+#include "spa/utils/dict.h"
+#include "spa/utils/hook.h"
+#include <cstdint>
+#include <deque>
+#include <spa/param/audio/format-utils.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using std::deque;
+using std::string;
+using std::to_string;
+using std::unordered_map;
+using std::vector;
+
+/**
+a scripted daemon behind Backend::ops, for running the node lifecycle without pipewire. node globals are added and
+removed by hand, everything the daemon would send back, registry globals, proxy info and params and stream states, goes
+through one queue that step(), deliver_round() and pump() work through in order, the way it would arrive from the
+socket. Props written to an onode are echoed to every proxy subscribed to them. only the objects are simulated, timers
+still run on a real pw_loop
+*/
+class SimBackend {
+  public:
+    // how far a node global got before its removal reached the registry listener
+    enum stage : uint32_t { ANNOUNCED, BOUND, INFO, FORMAT, SYNCING, STAGE_COUNT };
+
+  private:
+    // an id can be reused before the old global's removal is delivered, globals are keyed by serial
+    struct sim_global {
+        uint32_t id;
+        uint64_t serial;
+        string pid;
+        string binary;
+        string media_class;
+        string media_name;
+        bool negotiated;
+        spa_audio_info_raw format;
+        props_state props;
+        stage reached;
+        bool removed;
+    };
+
+    struct sim_proxy {
+        uint64_t key;
+        uint64_t serial;
+        struct spa_hook_list listeners;
+        bool format_subscribed;
+        bool props_subscribed;
+    };
+
+    struct sim_stream {
+        uint64_t key;
+        uint32_t node_id;
+        struct pw_properties *props;
+        struct spa_hook_list listeners;
+        enum pw_stream_state state;
+    };
+
+    struct sim_core {
+        struct spa_hook_list listeners;
+    };
+
+    enum class event_kind { NODE_GLOBAL, STREAM_GLOBAL, GLOBAL_REMOVE, NODE_INFO, NODE_PARAM, STREAM_PAUSED };
+
+    // the target is looked up again on delivery, one destroyed in the meantime gets nothing
+    struct sim_event {
+        event_kind kind;
+        uint64_t key;
+        uint32_t id;
+    };
+
+    static constexpr uint32_t FIRST_STREAM_ID = 1000000;
+
+    inline static struct spa_hook_list registry_listeners = {};
+    inline static uint32_t registry_marker = 0;
+
+    inline static unordered_map<uint64_t, sim_global> globals = {};
+    // the newest global per id, and the one the registry listener last saw, which a bind reaches
+    inline static unordered_map<uint32_t, uint64_t> global_serials = {};
+    inline static unordered_map<uint32_t, uint64_t> announced_serials = {};
+    inline static unordered_map<uint64_t, sim_proxy *> proxies = {};
+    inline static unordered_map<uint64_t, sim_stream *> streams = {};
+    inline static unordered_map<uint32_t, sim_stream *> stream_nodes = {};
+    inline static uint32_t cores = 0;
+
+    inline static deque<sim_event> events = {};
+    // freed once the event that destroyed them returns
+    inline static vector<sim_proxy *> dead_proxies = {};
+    inline static vector<sim_stream *> dead_streams = {};
+
+    inline static uint64_t next_key = 1;
+    inline static uint32_t next_stream_id = FIRST_STREAM_ID;
+    inline static uint64_t delivered = 0;
+    inline static uint32_t removed_at[STAGE_COUNT] = {};
+
+    static void reach(sim_global &global, stage reached) {
+        if (global.reached < reached)
+            global.reached = reached;
+    }
+
+    static sim_global *find_global(uint64_t serial) {
+        auto it = globals.find(serial);
+        return it == globals.end() ? nullptr : &it->second;
+    }
+
+    static struct pw_core *connect_app(struct pw_loop *loop, const char *app_name, const char *remote,
+                                       struct pw_context **context) {
+        auto *core = new sim_core();
+        spa_hook_list_init(&core->listeners);
+        *context = nullptr;
+        cores++;
+        return (struct pw_core *)core;
+    }
+
+    static void disconnect_app(struct pw_context *context, struct pw_core *core) {
+        if (!core)
+            return;
+
+        delete (sim_core *)core;
+        cores--;
+    }
+
+    static void add_core_listener(struct pw_core *core, struct spa_hook *hook, const struct pw_core_events *events,
+                                  void *data) {
+        spa_hook_list_append(&((sim_core *)core)->listeners, hook, events, data);
+    }
+
+    // the daemon sends info right after a bind, even to a global whose removal is already on its way
+    static struct pw_node *bind_node(struct pw_registry *registry, uint32_t id, const char *type) {
+        auto *proxy = new sim_proxy();
+        proxy->key = next_key++;
+        proxy->serial = 0;
+        proxy->format_subscribed = false;
+        proxy->props_subscribed = false;
+        spa_hook_list_init(&proxy->listeners);
+        proxies[proxy->key] = proxy;
+
+        auto it = announced_serials.find(id);
+        if (it != announced_serials.end()) {
+            proxy->serial = it->second;
+            reach(globals[it->second], BOUND);
+            events.push_back({event_kind::NODE_INFO, proxy->key, id});
+        }
+
+        return (struct pw_node *)proxy;
+    }
+
+    static void add_node_listener(struct pw_node *node, struct spa_hook *hook, const struct pw_node_events *events,
+                                  void *data) {
+        spa_hook_list_append(&((sim_proxy *)node)->listeners, hook, events, data);
+    }
+
+    // subscribing replaces the previous ids and sends the current value of each, if there is one
+    static void subscribe_params(struct pw_node *node, uint32_t *ids, uint32_t n_ids) {
+        auto *proxy = (sim_proxy *)node;
+        sim_global *global = SimBackend::find_global(proxy->serial);
+        proxy->format_subscribed = false;
+        proxy->props_subscribed = false;
+
+        for (uint32_t i = 0; i < n_ids; i++) {
+            if (ids[i] == SPA_PARAM_Format)
+                proxy->format_subscribed = true;
+            else if (ids[i] == SPA_PARAM_Props)
+                proxy->props_subscribed = true;
+            else
+                continue;
+
+            if (global && (ids[i] != SPA_PARAM_Format || global->negotiated))
+                events.push_back({event_kind::NODE_PARAM, proxy->key, ids[i]});
+        }
+
+        if (global && proxy->props_subscribed)
+            reach(*global, SYNCING);
+    }
+
+    static void send_param(sim_global &global, uint32_t id) {
+        for (const auto &[key, proxy] : proxies) {
+            if (proxy->serial != global.serial)
+                continue;
+
+            if ((id == SPA_PARAM_Format && proxy->format_subscribed) ||
+                (id == SPA_PARAM_Props && proxy->props_subscribed))
+                events.push_back({event_kind::NODE_PARAM, key, id});
+        }
+    }
+
+    static void set_param(struct pw_node *node, uint32_t id, const struct spa_pod *param) {
+        sim_global *global = SimBackend::find_global(((sim_proxy *)node)->serial);
+        if (id != SPA_PARAM_Props || !global || global->removed)
+            return;
+
+        props_state written = props_state::parse(param);
+        global->props.merge(written, written.fields);
+        SimBackend::send_param(*global, SPA_PARAM_Props);
+    }
+
+    static void destroy_proxy(struct pw_proxy *proxy) {
+        auto *sim = (sim_proxy *)proxy;
+        proxies.erase(sim->key);
+        dead_proxies.push_back(sim);
+    }
+
+    static struct pw_stream *new_stream(struct pw_core *core, const char *name, struct pw_properties *props) {
+        auto *stream = new sim_stream();
+        stream->key = next_key++;
+        stream->node_id = SPA_ID_INVALID;
+        stream->props = props;
+        stream->state = PW_STREAM_STATE_UNCONNECTED;
+        spa_hook_list_init(&stream->listeners);
+        streams[stream->key] = stream;
+        return (struct pw_stream *)stream;
+    }
+
+    static void add_stream_listener(struct pw_stream *stream, struct spa_hook *hook,
+                                    const struct pw_stream_events *events, void *data) {
+        spa_hook_list_append(&((sim_stream *)stream)->listeners, hook, events, data);
+    }
+
+    static void set_stream_state(sim_stream &stream, enum pw_stream_state state) {
+        enum pw_stream_state old = stream.state;
+        stream.state = state;
+        spa_hook_list_call(&stream.listeners, struct pw_stream_events, state_changed, 0, old, state, nullptr);
+    }
+
+    static void connect_stream(struct pw_stream *stream, enum pw_stream_flags flags, const struct spa_pod **params,
+                               uint32_t n_params) {
+        auto *sim = (sim_stream *)stream;
+        SimBackend::set_stream_state(*sim, PW_STREAM_STATE_CONNECTING);
+        events.push_back({event_kind::STREAM_PAUSED, sim->key, 0});
+    }
+
+    static void update_stream_params(struct pw_stream *stream, const struct spa_pod **params, uint32_t n_params) {
+    }
+
+    static void update_stream_properties(struct pw_stream *stream, const struct spa_dict *dict) {
+        pw_properties_update(((sim_stream *)stream)->props, dict);
+    }
+
+    // the stream's node is in this process, so its param_changed fires during the call
+    static void set_stream_param(struct pw_stream *stream, uint32_t id, const struct spa_pod *param) {
+        spa_hook_list_call(&((sim_stream *)stream)->listeners, struct pw_stream_events, param_changed, 0, id, param);
+    }
+
+    static uint32_t stream_node_id(struct pw_stream *stream) {
+        return ((sim_stream *)stream)->node_id;
+    }
+
+    // disconnecting fires a last state change, the node then leaves the registry
+    static void destroy_stream(struct pw_stream *stream) {
+        auto *sim = (sim_stream *)stream;
+
+        if (sim->state != PW_STREAM_STATE_UNCONNECTED)
+            SimBackend::set_stream_state(*sim, PW_STREAM_STATE_UNCONNECTED);
+
+        if (sim->node_id != SPA_ID_INVALID) {
+            stream_nodes.erase(sim->node_id);
+            events.push_back({event_kind::GLOBAL_REMOVE, 0, sim->node_id});
+        }
+
+        streams.erase(sim->key);
+        dead_streams.push_back(sim);
+    }
+
+    static void emit_node_global(sim_global &global) {
+        string serial = to_string(global.serial);
+        struct spa_dict_item items[] = {{PW_KEY_OBJECT_SERIAL, serial.c_str()},
+                                        {PW_KEY_MEDIA_CLASS, global.media_class.c_str()}};
+        struct spa_dict dict = SPA_DICT_INIT(items, 2);
+
+        spa_hook_list_call(&registry_listeners, struct pw_registry_events, global, 0, global.id, PW_PERM_ALL,
+                           PW_TYPE_INTERFACE_Node, PW_VERSION_NODE, &dict);
+    }
+
+    static void emit_node_info(sim_proxy &proxy, sim_global &global) {
+        string serial = to_string(global.serial);
+        struct spa_dict_item items[] = {{PW_KEY_OBJECT_SERIAL, serial.c_str()},
+                                        {PW_KEY_APP_PROCESS_ID, global.pid.c_str()},
+                                        {PW_KEY_APP_PROCESS_BINARY, global.binary.c_str()},
+                                        {PW_KEY_MEDIA_CLASS, global.media_class.c_str()},
+                                        {PW_KEY_MEDIA_NAME, global.media_name.c_str()}};
+        struct spa_dict dict = SPA_DICT_INIT(items, 5);
+
+        struct pw_node_info info = {};
+        info.id = global.id;
+        info.change_mask = PW_NODE_CHANGE_MASK_PROPS | PW_NODE_CHANGE_MASK_STATE;
+        info.state = PW_NODE_STATE_RUNNING;
+        info.props = &dict;
+
+        reach(global, INFO);
+        spa_hook_list_call(&proxy.listeners, struct pw_node_events, info, 0, &info);
+    }
+
+    static void emit_node_param(sim_proxy &proxy, sim_global &global, uint32_t id) {
+        uint8_t buffer[4096];
+        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        struct spa_pod *param;
+
+        if (id == SPA_PARAM_Format) {
+            reach(global, FORMAT);
+            param = spa_format_audio_raw_build(&builder, SPA_PARAM_Format, &global.format);
+        } else {
+            param = global.props.build(builder, global.props.fields);
+        }
+
+        spa_hook_list_call(&proxy.listeners, struct pw_node_events, param, 0, 0, id, 0, 1, param);
+    }
+
+    // the stream's node shows up in the registry like any other, marked as a replica
+    static void emit_stream_global(sim_stream &stream) {
+        spa_hook_list_call(&registry_listeners, struct pw_registry_events, global, 0, stream.node_id, PW_PERM_ALL,
+                           PW_TYPE_INTERFACE_Node, PW_VERSION_NODE, &stream.props->dict);
+    }
+
+    static void emit_global_remove(uint64_t serial, uint32_t id) {
+        sim_global *global = SimBackend::find_global(serial);
+        if (global) {
+            removed_at[global->reached]++;
+            globals.erase(serial);
+        }
+
+        auto it = announced_serials.find(id);
+        if (it != announced_serials.end() && it->second == serial)
+            announced_serials.erase(it);
+
+        spa_hook_list_call(&registry_listeners, struct pw_registry_events, global_remove, 0, id);
+    }
+
+    static void deliver(const sim_event &event) {
+        if (event.kind == event_kind::NODE_GLOBAL) {
+            announced_serials[event.id] = event.key;
+            SimBackend::emit_node_global(globals[event.key]);
+            return;
+        }
+
+        if (event.kind == event_kind::GLOBAL_REMOVE) {
+            SimBackend::emit_global_remove(event.key, event.id);
+            return;
+        }
+
+        if (event.kind == event_kind::STREAM_GLOBAL || event.kind == event_kind::STREAM_PAUSED) {
+            auto it = streams.find(event.key);
+            if (it == streams.end())
+                return;
+
+            if (event.kind == event_kind::STREAM_GLOBAL) {
+                SimBackend::emit_stream_global(*it->second);
+                return;
+            }
+
+            it->second->node_id = next_stream_id++;
+            stream_nodes[it->second->node_id] = it->second;
+            events.push_back({event_kind::STREAM_GLOBAL, event.key, 0});
+            SimBackend::set_stream_state(*it->second, PW_STREAM_STATE_PAUSED);
+            return;
+        }
+
+        // what was sent before the global went away still arrives, nothing comes after its removal
+        auto proxy = proxies.find(event.key);
+        if (proxy == proxies.end())
+            return;
+
+        sim_global *global = SimBackend::find_global(proxy->second->serial);
+        if (!global)
+            return;
+
+        if (event.kind == event_kind::NODE_INFO)
+            SimBackend::emit_node_info(*proxy->second, *global);
+        else
+            SimBackend::emit_node_param(*proxy->second, *global, event.id);
+    }
+
+    static void free_dead() {
+        for (sim_proxy *proxy : dead_proxies)
+            delete proxy;
+        dead_proxies.clear();
+
+        for (sim_stream *stream : dead_streams) {
+            pw_properties_free(stream->props);
+            delete stream;
+        }
+        dead_streams.clear();
+    }
+
+  public:
+    inline static const Backend::ops OPS = {
+        .connect_app = SimBackend::connect_app,
+        .disconnect_app = SimBackend::disconnect_app,
+        .add_core_listener = SimBackend::add_core_listener,
+        .bind_node = SimBackend::bind_node,
+        .add_node_listener = SimBackend::add_node_listener,
+        .subscribe_params = SimBackend::subscribe_params,
+        .set_param = SimBackend::set_param,
+        .destroy_proxy = SimBackend::destroy_proxy,
+        .new_stream = SimBackend::new_stream,
+        .add_stream_listener = SimBackend::add_stream_listener,
+        .connect_stream = SimBackend::connect_stream,
+        .update_stream_params = SimBackend::update_stream_params,
+        .update_stream_properties = SimBackend::update_stream_properties,
+        .set_stream_param = SimBackend::set_stream_param,
+        .stream_node_id = SimBackend::stream_node_id,
+        .destroy_stream = SimBackend::destroy_stream,
+    };
+
+    static void start() {
+        spa_hook_list_init(&registry_listeners);
+        Backend::use(SimBackend::OPS);
+    }
+
+    static struct pw_registry *registry() {
+        return (struct pw_registry *)&registry_marker;
+    }
+
+    static void add_registry_listener(struct spa_hook *hook, const struct pw_registry_events *events, void *data) {
+        spa_hook_list_append(&registry_listeners, hook, events, data);
+    }
+
+    // announced on the next delivery, one that isn't negotiated gets its Format from negotiate()
+    static void add_node(uint32_t id, const string &binary, const string &media_class, bool negotiated = true) {
+        uint64_t serial = next_key++;
+        sim_global &global = globals[serial];
+        global.id = id;
+        global.serial = serial;
+        global.pid = to_string(10000 + id);
+        global.binary = binary;
+        global.media_class = media_class;
+        global.media_name = "stream " + to_string(id);
+        global.negotiated = negotiated;
+        global.format = {};
+        global.format.format = SPA_AUDIO_FORMAT_F32;
+        global.format.rate = 48000;
+        global.format.channels = 2;
+        global.format.position[0] = SPA_AUDIO_CHANNEL_FL;
+        global.format.position[1] = SPA_AUDIO_CHANNEL_FR;
+        global.props = props_state();
+        global.props.fields = props_state::VOLUME | props_state::MUTE;
+        global.reached = ANNOUNCED;
+        global.removed = false;
+
+        global_serials[id] = serial;
+        events.push_back({event_kind::NODE_GLOBAL, serial, id});
+    }
+
+    static void remove_node(uint32_t id) {
+        auto it = global_serials.find(id);
+        if (it == global_serials.end())
+            return;
+
+        globals[it->second].removed = true;
+        events.push_back({event_kind::GLOBAL_REMOVE, it->second, id});
+        global_serials.erase(it);
+    }
+
+    // the stream got linked, its Format goes to every proxy subscribed to it
+    static void negotiate(uint32_t id) {
+        auto it = global_serials.find(id);
+        if (it == global_serials.end() || globals[it->second].negotiated)
+            return;
+
+        globals[it->second].negotiated = true;
+        SimBackend::send_param(globals[it->second], SPA_PARAM_Format);
+    }
+
+    static bool set_stream_volume(uint32_t node_id, float volume) {
+        auto it = stream_nodes.find(node_id);
+        if (it == stream_nodes.end())
+            return false;
+
+        props_state props;
+        props.fields = props_state::VOLUME;
+        props.volume = volume;
+
+        uint8_t buffer[1024];
+        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        SimBackend::set_stream_param((struct pw_stream *)it->second, SPA_PARAM_Props,
+                                     props.build(builder, props_state::VOLUME));
+        return true;
+    }
+
+    static bool step() {
+        if (events.empty())
+            return false;
+
+        sim_event event = events.front();
+        events.pop_front();
+        SimBackend::deliver(event);
+        SimBackend::free_dead();
+        delivered++;
+        return true;
+    }
+
+    // delivers what is queued now, what that queues in turn waits for the next round
+    static void deliver_round() {
+        for (size_t queued = events.size(); queued > 0; queued--)
+            SimBackend::step();
+    }
+
+    // delivers everything, including what the deliveries queue, and runs the timers that are due on the way
+    static void pump(struct pw_loop *loop) {
+        int dispatched;
+
+        do {
+            while (SimBackend::step()) {
+            }
+
+            dispatched = pw_loop_iterate(loop, 0);
+            SimBackend::free_dead();
+        } while (dispatched > 0 || !events.empty());
+    }
+
+    static vector<uint32_t> stream_ids() {
+        vector<uint32_t> ids = {};
+        for (const auto &[id, stream] : stream_nodes)
+            ids.push_back(id);
+        return ids;
+    }
+
+    static uint64_t delivered_events() {
+        return delivered;
+    }
+
+    static uint32_t removals_at(stage reached) {
+        return removed_at[reached];
+    }
+
+    static uint32_t live_proxies() {
+        return proxies.size();
+    }
+
+    static uint32_t live_streams() {
+        return streams.size();
+    }
+
+    static uint32_t live_cores() {
+        return cores;
+    }
+};
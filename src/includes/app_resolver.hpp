@@ -0,0 +1,470 @@
+#pragma once
+
+#include "logger.hpp"
+#include "pipewire/loop.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+using std::deque;
+using std::ifstream;
+using std::lock_guard;
+using std::mutex;
+using std::ofstream;
+using std::string;
+using std::thread;
+using std::unordered_map;
+using std::vector;
+
+/**
+maps a stream's process to the app it belongs to, using /proc and the installed .desktop files. everything touching the
+filesystem runs on a worker thread, results are handed back on the pipewire loop through an event source
+*/
+class AppResolver {
+  public:
+    struct app_identity {
+        string name;
+        string icon;
+    };
+
+    // owner and tag are passed through untouched. owner tells requests with the same id from different callers apart,
+    // the tag a request from one that reused the id
+    typedef void (*resolved_callback)(void *owner, uint32_t request_id, uint64_t tag, const app_identity &identity);
+
+  private:
+    struct request {
+        void *owner;
+        uint32_t id;
+        uint64_t tag;
+        uint32_t pid;
+        string fallback;
+    };
+
+    struct result {
+        void *owner;
+        uint32_t id;
+        uint64_t tag;
+        app_identity identity;
+    };
+
+    inline static struct pw_loop *loop = nullptr;
+    inline static struct spa_source *result_event = nullptr;
+    inline static resolved_callback on_resolved = nullptr;
+
+    inline static thread worker;
+    inline static int wake_fd = -1;
+    inline static bool stopping = false;
+
+    inline static mutex queue_lock;
+    inline static deque<request> requests = {};
+    inline static deque<result> results = {};
+
+    // only touched by the worker thread
+    inline static unordered_map<string, app_identity> desktop_index = {};
+
+    static string lowercase(string str) {
+        transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return tolower(c); });
+        return str;
+    }
+
+    static string basename_of(const string &path) {
+        size_t slash = path.find_last_of('/');
+        return slash == string::npos ? path : path.substr(slash + 1);
+    }
+
+    static string cache_path() {
+        const char *cache_home = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+
+        if (cache_home && cache_home[0] != '\0')
+            return string(cache_home) + "/pipetron/desktop-index";
+
+        if (home && home[0] != '\0')
+            return string(home) + "/.cache/pipetron/desktop-index";
+
+        return "";
+    }
+
+    static vector<string> application_dirs() {
+        vector<string> dirs = {};
+        const char *data_home = getenv("XDG_DATA_HOME");
+        const char *home = getenv("HOME");
+        const char *data_dirs = getenv("XDG_DATA_DIRS");
+
+        if (data_home && data_home[0] != '\0')
+            dirs.push_back(string(data_home) + "/applications");
+        else if (home && home[0] != '\0')
+            dirs.push_back(string(home) + "/.local/share/applications");
+
+        std::istringstream stream(data_dirs && data_dirs[0] != '\0' ? data_dirs : "/usr/local/share:/usr/share");
+        string dir;
+        while (getline(stream, dir, ':')) {
+            if (!dir.empty())
+                dirs.push_back(dir + "/applications");
+        }
+
+        return dirs;
+    }
+
+    // first word of an Exec line, skipping an "env VAR=value" prefix
+    static string exec_binary(const string &exec) {
+        std::istringstream stream(exec);
+        string word;
+
+        while (stream >> word) {
+            if (word == "env" || word.find('=') != string::npos)
+                continue;
+
+            word.erase(remove(word.begin(), word.end(), '"'), word.end());
+            return basename_of(word);
+        }
+
+        return "";
+    }
+
+    static void index_desktop_file(const string &path, const string &desktop_id,
+                                   unordered_map<string, app_identity> &index) {
+        ifstream file(path);
+        string line, name, icon, exec, wm_class;
+        bool in_entry = false;
+
+        while (getline(file, line)) {
+            if (!line.empty() && line[0] == '[') {
+                in_entry = line == "[Desktop Entry]";
+                continue;
+            }
+
+            if (!in_entry)
+                continue;
+
+            if (line.rfind("Name=", 0) == 0)
+                name = line.substr(5);
+            else if (line.rfind("Icon=", 0) == 0)
+                icon = line.substr(5);
+            else if (line.rfind("Exec=", 0) == 0)
+                exec = line.substr(5);
+            else if (line.rfind("StartupWMClass=", 0) == 0)
+                wm_class = line.substr(15);
+        }
+
+        if (name.empty())
+            return;
+
+        app_identity identity = {name, icon.empty() ? desktop_id : icon};
+
+        // earlier directories take precedence, like desktop environments do
+        index.emplace(lowercase(desktop_id), identity);
+        if (!wm_class.empty())
+            index.emplace(lowercase(wm_class), identity);
+
+        string binary = exec_binary(exec);
+        if (!binary.empty())
+            index.emplace(lowercase(binary), identity);
+    }
+
+    static void build_desktop_index() {
+        unordered_map<string, app_identity> index = {};
+
+        for (const string &dir_path : application_dirs()) {
+            DIR *dir = opendir(dir_path.c_str());
+            if (!dir)
+                continue;
+
+            while (struct dirent *entry = readdir(dir)) {
+                string file_name = entry->d_name;
+                if (file_name.size() <= 8 || file_name.compare(file_name.size() - 8, 8, ".desktop") != 0)
+                    continue;
+
+                index_desktop_file(dir_path + "/" + file_name, file_name.substr(0, file_name.size() - 8), index);
+            }
+
+            closedir(dir);
+        }
+
+        desktop_index = index;
+        Logger::info({.phase = "resolve"}, "Indexed %zu desktop entry names", desktop_index.size());
+        save_desktop_index();
+    }
+
+    static void save_desktop_index() {
+        string path = cache_path();
+        if (path.empty())
+            return;
+
+        string dir = path.substr(0, path.find_last_of('/'));
+        mkdir(dir.substr(0, dir.find_last_of('/')).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+
+        // written aside and renamed, so a crash never leaves a truncated cache behind
+        ofstream file(path + ".tmp", std::ios::trunc);
+        for (const auto &[key, identity] : desktop_index)
+            file << key << '\t' << identity.name << '\t' << identity.icon << '\n';
+        file.close();
+
+        if (file.good())
+            rename((path + ".tmp").c_str(), path.c_str());
+    }
+
+    // the cache is only used while no applications directory changed after it was written
+    static bool load_desktop_index() {
+        string path = cache_path();
+        struct stat cache_stat;
+
+        if (path.empty() || stat(path.c_str(), &cache_stat) != 0)
+            return false;
+
+        for (const string &dir : application_dirs()) {
+            struct stat dir_stat;
+            if (stat(dir.c_str(), &dir_stat) == 0 && dir_stat.st_mtime >= cache_stat.st_mtime)
+                return false;
+        }
+
+        ifstream file(path);
+        string line;
+        while (getline(file, line)) {
+            size_t first = line.find('\t');
+            size_t second = first == string::npos ? string::npos : line.find('\t', first + 1);
+
+            if (second == string::npos)
+                continue;
+
+            desktop_index[line.substr(0, first)] = {line.substr(first + 1, second - first - 1),
+                                                    line.substr(second + 1)};
+        }
+
+        return !desktop_index.empty();
+    }
+
+    static vector<string> read_cmdline(uint32_t pid) {
+        ifstream file("/proc/" + std::to_string(pid) + "/cmdline");
+        vector<string> args = {};
+        string arg;
+
+        while (getline(file, arg, '\0'))
+            args.push_back(arg);
+
+        return args;
+    }
+
+    static uint32_t parent_pid(uint32_t pid) {
+        ifstream file("/proc/" + std::to_string(pid) + "/stat");
+        string stat;
+        getline(file, stat);
+
+        // the command name may hold spaces and parentheses, fields resume after the last ')'
+        size_t end = stat.find_last_of(')');
+        if (end == string::npos)
+            return 0;
+
+        std::istringstream fields(stat.substr(end + 1));
+        string state;
+        uint32_t ppid = 0;
+        fields >> state >> ppid;
+        return ppid;
+    }
+
+    static bool is_child_process(const vector<string> &args) {
+        for (const string &arg : args) {
+            if (arg.rfind("--type=", 0) == 0)
+                return true;
+        }
+
+        return false;
+    }
+
+    // names the process could be known by, most specific first
+    static vector<string> candidate_names(uint32_t pid) {
+        vector<string> candidates = {};
+        vector<string> args = read_cmdline(pid);
+
+        // chromium plays audio from a utility process, the app itself is only visible on the browser process
+        for (uint32_t depth = 0; depth < 8 && is_child_process(args); depth++) {
+            uint32_t ppid = parent_pid(pid);
+            if (ppid <= 1)
+                break;
+
+            pid = ppid;
+            args = read_cmdline(pid);
+        }
+
+        char exe[4096];
+        ssize_t exe_size = readlink(("/proc/" + std::to_string(pid) + "/exe").c_str(), exe, sizeof(exe) - 1);
+        string binary = exe_size > 0 ? basename_of(string(exe, exe_size)) : (args.empty() ? "" : basename_of(args[0]));
+
+        // a shared electron runtime gets the app's path as its first argument, named after the app directory
+        if (lowercase(binary).rfind("electron", 0) == 0) {
+            for (size_t i = 1; i < args.size(); i++) {
+                if (args[i].empty() || args[i][0] == '-')
+                    continue;
+
+                std::istringstream path(args[i]);
+                vector<string> components = {};
+                string component;
+                while (getline(path, component, '/')) {
+                    string lower = lowercase(component);
+                    if (!component.empty() && lower != "app.asar" && lower != "resources" && lower != "app" &&
+                        lower != "usr" && lower != "lib" && lower != "lib64" && lower != "share" && lower != "opt")
+                        components.push_back(component);
+                }
+
+                candidates.insert(candidates.end(), components.rbegin(), components.rend());
+                break;
+            }
+        }
+
+        if (!binary.empty())
+            candidates.push_back(binary);
+
+        return candidates;
+    }
+
+    static app_identity resolve_pid(uint32_t pid, const string &fallback) {
+        vector<string> candidates = candidate_names(pid);
+
+        for (const string &candidate : candidates) {
+            auto it = desktop_index.find(lowercase(candidate));
+            if (it != desktop_index.end())
+                return it->second;
+        }
+
+        if (!candidates.empty())
+            return {candidates.front(), candidates.front()};
+
+        return {fallback, fallback};
+    }
+
+    static int watch_application_dirs() {
+        int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0)
+            return -1;
+
+        for (const string &dir : application_dirs())
+            inotify_add_watch(inotify_fd, dir.c_str(),
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE);
+
+        return inotify_fd;
+    }
+
+    static void run_worker() {
+        if (!load_desktop_index())
+            build_desktop_index();
+
+        int inotify_fd = watch_application_dirs();
+
+        while (true) {
+            struct pollfd fds[2] = {{wake_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+            if (poll(fds, inotify_fd >= 0 ? 2 : 1, -1) < 0 && errno != EINTR)
+                break;
+
+            if (inotify_fd >= 0 && (fds[1].revents & POLLIN)) {
+                char events[4096];
+                while (read(inotify_fd, events, sizeof(events)) > 0)
+                    ;
+                build_desktop_index();
+            }
+
+            uint64_t count;
+            if (fds[0].revents & POLLIN) {
+                ssize_t got = read(wake_fd, &count, sizeof(count));
+                (void)got;
+            }
+
+            deque<request> pending;
+            {
+                lock_guard<mutex> guard(queue_lock);
+                if (stopping)
+                    break;
+                pending.swap(requests);
+            }
+
+            if (pending.empty())
+                continue;
+
+            deque<result> resolved;
+            for (const request &req : pending)
+                resolved.push_back({req.owner, req.id, req.tag, resolve_pid(req.pid, req.fallback)});
+
+            {
+                lock_guard<mutex> guard(queue_lock);
+                results.insert(results.end(), resolved.begin(), resolved.end());
+            }
+            pw_loop_signal_event(loop, result_event);
+        }
+
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+    }
+
+    static void on_results(void *data, uint64_t count) {
+        deque<result> ready;
+        {
+            lock_guard<mutex> guard(queue_lock);
+            ready.swap(results);
+        }
+
+        for (const result &res : ready)
+            on_resolved(res.owner, res.id, res.tag, res.identity);
+    }
+
+  public:
+    static bool running() {
+        return worker.joinable();
+    }
+
+    static void start(struct pw_loop *main_loop, resolved_callback callback) {
+        loop = main_loop;
+        on_resolved = callback;
+        stopping = false;
+
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        result_event = pw_loop_add_event(loop, AppResolver::on_results, nullptr);
+        worker = thread(AppResolver::run_worker);
+    }
+
+    // the callback runs later on the pipewire loop with the same owner, request id and tag
+    static void resolve(void *owner, uint32_t request_id, uint64_t tag, uint32_t pid, const string &fallback) {
+        {
+            lock_guard<mutex> guard(queue_lock);
+            requests.push_back({owner, request_id, tag, pid, fallback});
+        }
+
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+
+    static void stop() {
+        if (!running())
+            return;
+
+        {
+            lock_guard<mutex> guard(queue_lock);
+            stopping = true;
+        }
+
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written;
+        worker.join();
+
+        pw_loop_destroy_source(loop, result_event);
+        result_event = nullptr;
+        close(wake_fd);
+        wake_fd = -1;
+    }
+};
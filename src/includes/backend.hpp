@@ -0,0 +1,178 @@
+#pragma once
+
+#include "pipewire/context.h"
+#include "pipewire/core.h"
+#include "pipewire/keys.h"
+#include "pipewire/loop.h"
+#include "pipewire/node.h"
+#include "pipewire/properties.h"
+#include "pipewire/proxy.h"
+#include "pipewire/stream.h"
+#include "spa/utils/dict.h"
+#include "spa/utils/hook.h"
+#include <cstdint>
+
+/**
+the registry, node and stream calls the node lifecycle makes, behind a table of function pointers. NATIVE forwards to
+libpipewire, another table can be installed with Backend::use() before anything is bound so the lifecycle runs against
+scripted events instead of a daemon. loop sources stay on pw_loop, which works without a daemon
+*/
+class Backend {
+  public:
+    struct ops {
+        // per app client connections, a context and core on the given loop, to the named remote or the default one
+        // when it is empty
+        struct pw_core *(*connect_app)(struct pw_loop *loop, const char *app_name, const char *remote,
+                                       struct pw_context **context);
+        void (*disconnect_app)(struct pw_context *context, struct pw_core *core);
+        void (*add_core_listener)(struct pw_core *core, struct spa_hook *hook, const struct pw_core_events *events,
+                                  void *data);
+
+        // onode proxies, bound through the daemon registry. subscribing also delivers the current values
+        struct pw_node *(*bind_node)(struct pw_registry *registry, uint32_t id, const char *type);
+        void (*add_node_listener)(struct pw_node *node, struct spa_hook *hook, const struct pw_node_events *events,
+                                  void *data);
+        void (*subscribe_params)(struct pw_node *node, uint32_t *ids, uint32_t n_ids);
+        void (*set_param)(struct pw_node *node, uint32_t id, const struct spa_pod *param);
+        void (*destroy_proxy)(struct pw_proxy *proxy);
+
+        // replicated streams
+        struct pw_stream *(*new_stream)(struct pw_core *core, const char *name, struct pw_properties *props);
+        void (*add_stream_listener)(struct pw_stream *stream, struct spa_hook *hook,
+                                    const struct pw_stream_events *events, void *data);
+        void (*connect_stream)(struct pw_stream *stream, enum pw_stream_flags flags, const struct spa_pod **params,
+                               uint32_t n_params);
+        void (*update_stream_params)(struct pw_stream *stream, const struct spa_pod **params, uint32_t n_params);
+        void (*update_stream_properties)(struct pw_stream *stream, const struct spa_dict *dict);
+        void (*set_stream_param)(struct pw_stream *stream, uint32_t id, const struct spa_pod *param);
+        uint32_t (*stream_node_id)(struct pw_stream *stream);
+        void (*destroy_stream)(struct pw_stream *stream);
+    };
+
+  private:
+    // the daemon's own context when running as a module, app connections are then in-process clients of it
+    inline static struct pw_context *host_context = nullptr;
+
+    static struct pw_core *native_connect_app(struct pw_loop *loop, const char *app_name, const char *remote,
+                                              struct pw_context **context) {
+        if (host_context) {
+            *context = nullptr;
+            return pw_context_connect_self(host_context, pw_properties_new(PW_KEY_APP_NAME, app_name, nullptr), 0);
+        }
+
+        struct pw_properties *context_props = pw_properties_new(PW_KEY_APP_NAME, app_name, nullptr);
+        *context = pw_context_new(loop, context_props, 0);
+        if (!*context)
+            return nullptr;
+
+        struct pw_properties *connect_props =
+            remote[0] ? pw_properties_new(PW_KEY_REMOTE_NAME, remote, nullptr) : nullptr;
+        return pw_context_connect(*context, connect_props, 0);
+    }
+
+    static void native_disconnect_app(struct pw_context *context, struct pw_core *core) {
+        if (core)
+            pw_core_disconnect(core);
+        if (context)
+            pw_context_destroy(context);
+    }
+
+    static void native_add_core_listener(struct pw_core *core, struct spa_hook *hook,
+                                         const struct pw_core_events *events, void *data) {
+        pw_core_add_listener(core, hook, events, data);
+    }
+
+    static struct pw_node *native_bind_node(struct pw_registry *registry, uint32_t id, const char *type) {
+        return (struct pw_node *)pw_registry_bind(registry, id, type, PW_VERSION_NODE, 0);
+    }
+
+    static void native_add_node_listener(struct pw_node *node, struct spa_hook *hook,
+                                         const struct pw_node_events *events, void *data) {
+        pw_proxy_add_object_listener((struct pw_proxy *)node, hook, events, data);
+    }
+
+    static void native_subscribe_params(struct pw_node *node, uint32_t *ids, uint32_t n_ids) {
+        pw_node_subscribe_params(node, ids, n_ids);
+    }
+
+    static void native_set_param(struct pw_node *node, uint32_t id, const struct spa_pod *param) {
+        pw_node_set_param(node, id, 0, param);
+    }
+
+    static void native_destroy_proxy(struct pw_proxy *proxy) {
+        pw_proxy_destroy(proxy);
+    }
+
+    static struct pw_stream *native_new_stream(struct pw_core *core, const char *name, struct pw_properties *props) {
+        return pw_stream_new(core, name, props);
+    }
+
+    static void native_add_stream_listener(struct pw_stream *stream, struct spa_hook *hook,
+                                           const struct pw_stream_events *events, void *data) {
+        pw_stream_add_listener(stream, hook, events, data);
+    }
+
+    static void native_connect_stream(struct pw_stream *stream, enum pw_stream_flags flags,
+                                      const struct spa_pod **params, uint32_t n_params) {
+        pw_stream_connect(stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, flags, params, n_params);
+    }
+
+    static void native_update_stream_params(struct pw_stream *stream, const struct spa_pod **params,
+                                            uint32_t n_params) {
+        pw_stream_update_params(stream, params, n_params);
+    }
+
+    static void native_update_stream_properties(struct pw_stream *stream, const struct spa_dict *dict) {
+        pw_stream_update_properties(stream, dict);
+    }
+
+    static void native_set_stream_param(struct pw_stream *stream, uint32_t id, const struct spa_pod *param) {
+        pw_stream_set_param(stream, id, param);
+    }
+
+    static uint32_t native_stream_node_id(struct pw_stream *stream) {
+        return pw_stream_get_node_id(stream);
+    }
+
+    static void native_destroy_stream(struct pw_stream *stream) {
+        pw_stream_destroy(stream);
+    }
+
+  public:
+    inline static const ops NATIVE = {
+        .connect_app = Backend::native_connect_app,
+        .disconnect_app = Backend::native_disconnect_app,
+        .add_core_listener = Backend::native_add_core_listener,
+        .bind_node = Backend::native_bind_node,
+        .add_node_listener = Backend::native_add_node_listener,
+        .subscribe_params = Backend::native_subscribe_params,
+        .set_param = Backend::native_set_param,
+        .destroy_proxy = Backend::native_destroy_proxy,
+        .new_stream = Backend::native_new_stream,
+        .add_stream_listener = Backend::native_add_stream_listener,
+        .connect_stream = Backend::native_connect_stream,
+        .update_stream_params = Backend::native_update_stream_params,
+        .update_stream_properties = Backend::native_update_stream_properties,
+        .set_stream_param = Backend::native_set_stream_param,
+        .stream_node_id = Backend::native_stream_node_id,
+        .destroy_stream = Backend::native_destroy_stream,
+    };
+
+  private:
+    inline static const ops *current = &Backend::NATIVE;
+
+  public:
+    // must be called before the first node is bound, objects created through one table are destroyed through it
+    static void use(const ops &backend) {
+        current = &backend;
+    }
+
+    static const ops &get() {
+        return *current;
+    }
+
+    // must be called before the first app connection, NATIVE then connects apps to this context from within
+    static void host(struct pw_context *context) {
+        host_context = context;
+    }
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <time.h>
+
+// CLOCK_MONOTONIC, the clock bpftrace's nsecs reads, so timestamps taken here can be compared with a probe's
+inline uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
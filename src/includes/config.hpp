@@ -0,0 +1,260 @@
+#pragma once
+
+#include "logger.hpp"
+#include "node_rules.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+using std::ifstream;
+using std::string;
+using std::vector;
+
+/**
+config file is plain "key = value" lines, blank lines and lines starting with '#' are ignored. it can be reloaded while
+running, settings that are only used at startup keep their running value until the next restart
+*/
+class Config {
+  public:
+    // how long a released replicated node stays alive for reuse by a matching node, 0 disables reuse
+    inline static uint32_t vnode_grace_period_ms = 5000;
+
+    // replicated nodes are left inactive and unlinked, so they never get buffers or get scheduled by a driver
+    inline static bool vnode_control_only = false;
+
+    // upper bound on Props writes per second to each onode while a vnode slider is dragged, 0 disables the limit
+    inline static uint32_t props_max_rate_hz = 60;
+
+    // one replicated node per app binary and media class, synced to all of that app's streams
+    inline static bool vnode_aggregate = false;
+
+    // name and icon replicated nodes after the app found from the stream's process and .desktop files, rather than
+    // the process binary
+    inline static bool resolve_app_names = false;
+
+    // remember the last synced volume per app binary and media class, and set new streams to it as soon as they appear
+    inline static bool volume_cache = true;
+
+    // serve a metrics snapshot to every client of $XDG_RUNTIME_DIR/pipetron/metrics.sock, SIGUSR1 dumps it regardless
+    inline static bool metrics_socket = false;
+
+    // vnodes are only created once their onode first runs, and retired again after it stopped running for
+    // idle_retire_ms (0 keeps them)
+    inline static bool lazy_replication = false;
+    inline static uint32_t idle_retire_ms = 60000;
+
+    // in-app volume changes are taken over by the vnode instead of being overwritten with the vnode's Props
+    inline static bool bidirectional_sync = false;
+
+    // Props sync (vnode streams and onode Props writes) on its own thread loop, discovery and setup on the main loop
+    inline static bool sync_thread = false;
+
+    // lines below this level are not logged, debug lines also need a build with the debug_log option
+    inline static log_level log_threshold = log_level::INFO;
+
+    // node matching rules in config order, every "rule" line adds one, NodeRules::default_rules() when none are given
+    inline static vector<node_rule> rules = {};
+
+    // every setting at one point in time
+    struct settings {
+        uint32_t vnode_grace_period_ms;
+        bool vnode_control_only;
+        uint32_t props_max_rate_hz;
+        bool vnode_aggregate;
+        bool resolve_app_names;
+        bool volume_cache;
+        bool metrics_socket;
+        bool lazy_replication;
+        uint32_t idle_retire_ms;
+        bool bidirectional_sync;
+        bool sync_thread;
+        log_level log_threshold;
+        vector<node_rule> rules;
+    };
+
+  private:
+    // what every setting was before the first load, a reload starts over from them
+    inline static settings defaults = {};
+    inline static bool has_defaults = false;
+
+    static string trim(const string &str) {
+        size_t start = str.find_first_not_of(" \t\r");
+        size_t end = str.find_last_not_of(" \t\r");
+
+        if (start == string::npos)
+            return "";
+
+        return str.substr(start, end - start + 1);
+    }
+
+    static bool parse_uint(const string &value, uint32_t &out) {
+        char *end = nullptr;
+        unsigned long parsed = strtoul(value.c_str(), &end, 10);
+
+        if (value.empty() || *end != '\0' || value[0] == '-')
+            return false;
+
+        out = (uint32_t)parsed;
+        return true;
+    }
+
+    static bool parse_bool(const string &value, bool &out) {
+        if (value == "true" || value == "1") {
+            out = true;
+            return true;
+        }
+
+        if (value == "false" || value == "0") {
+            out = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    static void restore(const settings &values) {
+        vnode_grace_period_ms = values.vnode_grace_period_ms;
+        vnode_control_only = values.vnode_control_only;
+        props_max_rate_hz = values.props_max_rate_hz;
+        vnode_aggregate = values.vnode_aggregate;
+        resolve_app_names = values.resolve_app_names;
+        volume_cache = values.volume_cache;
+        metrics_socket = values.metrics_socket;
+        lazy_replication = values.lazy_replication;
+        idle_retire_ms = values.idle_retire_ms;
+        bidirectional_sync = values.bidirectional_sync;
+        sync_thread = values.sync_thread;
+        log_threshold = values.log_threshold;
+        rules = values.rules;
+    }
+
+    template <typename T> static void keep_running(const char *key, T &setting, T running) {
+        if (setting == running)
+            return;
+
+        Logger::warning({.phase = "config"}, "%s only changes on restart, keeping the running value", key);
+        setting = running;
+    }
+
+    static bool apply(const string &key, const string &value) {
+        if (key == "vnode_grace_period_ms")
+            return parse_uint(value, vnode_grace_period_ms);
+
+        if (key == "vnode_control_only")
+            return parse_bool(value, vnode_control_only);
+
+        if (key == "props_max_rate_hz")
+            return parse_uint(value, props_max_rate_hz);
+
+        if (key == "vnode_aggregate")
+            return parse_bool(value, vnode_aggregate);
+
+        if (key == "resolve_app_names")
+            return parse_bool(value, resolve_app_names);
+
+        if (key == "volume_cache")
+            return parse_bool(value, volume_cache);
+
+        if (key == "metrics_socket")
+            return parse_bool(value, metrics_socket);
+
+        if (key == "lazy_replication")
+            return parse_bool(value, lazy_replication);
+
+        if (key == "idle_retire_ms")
+            return parse_uint(value, idle_retire_ms);
+
+        if (key == "bidirectional_sync")
+            return parse_bool(value, bidirectional_sync);
+
+        if (key == "sync_thread")
+            return parse_bool(value, sync_thread);
+
+        if (key == "log_level")
+            return Logger::parse_level(value, log_threshold);
+
+        if (key == "rule")
+            return node_rule::parse(value, rules);
+
+        return false;
+    }
+
+  public:
+    static string default_path() {
+        const char *config_home = getenv("XDG_CONFIG_HOME");
+        const char *home = getenv("HOME");
+
+        if (config_home && config_home[0] != '\0')
+            return string(config_home) + "/pipetron/pipetron.conf";
+
+        if (home && home[0] != '\0')
+            return string(home) + "/.config/pipetron/pipetron.conf";
+
+        return "";
+    }
+
+    static settings capture() {
+        return {vnode_grace_period_ms, vnode_control_only, props_max_rate_hz, vnode_aggregate, resolve_app_names,
+                volume_cache, metrics_socket, lazy_replication, idle_retire_ms, bidirectional_sync, sync_thread,
+                log_threshold, rules};
+    }
+
+    // missing file keeps the defaults, malformed lines are reported and skipped
+    static void load(const string &path) {
+        if (!has_defaults) {
+            defaults = Config::capture();
+            has_defaults = true;
+        }
+
+        ifstream file(path);
+
+        if (!file.is_open())
+            return;
+
+        Logger::info({.phase = "config"}, "Loading config from %s", path.c_str());
+
+        string line;
+        uint32_t line_number = 0;
+        while (getline(file, line)) {
+            line_number++;
+            line = trim(line);
+
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            size_t separator = line.find('=');
+            if (separator == string::npos ||
+                !apply(trim(line.substr(0, separator)), trim(line.substr(separator + 1)))) {
+                Logger::warning({.phase = "config"}, "Ignoring invalid config line %u: %s", line_number, line.c_str());
+            }
+        }
+    }
+
+    // the file as it is now on top of the defaults, lines removed since the last load go back to their default
+    static void reload(const string &path) {
+        Config::restore(defaults);
+        Config::load(path);
+    }
+
+    // settings only read at startup, or baked into the vnodes already created, go back to what they were while running
+    static void keep_startup_settings(const settings &running) {
+        keep_running("vnode_aggregate", vnode_aggregate, running.vnode_aggregate);
+        keep_running("vnode_control_only", vnode_control_only, running.vnode_control_only);
+        keep_running("volume_cache", volume_cache, running.volume_cache);
+        keep_running("metrics_socket", metrics_socket, running.metrics_socket);
+        keep_running("lazy_replication", lazy_replication, running.lazy_replication);
+        keep_running("sync_thread", sync_thread, running.sync_thread);
+    }
+
+    // settings read on every use change without anything being recreated, the reload says so
+    static void log_live_changes(const settings &running) {
+        if (props_max_rate_hz != running.props_max_rate_hz)
+            Logger::info({.phase = "config"}, "props_max_rate_hz changed from %u to %u", running.props_max_rate_hz,
+                         props_max_rate_hz);
+
+        if (bidirectional_sync != running.bidirectional_sync)
+            Logger::info({.phase = "config"}, "bidirectional_sync turned %s, in-app volume changes are now %s",
+                         bidirectional_sync ? "on" : "off", bidirectional_sync ? "kept" : "undone");
+    }
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "logger.hpp"
+#include "pipewire/loop.h"
+#include <cstdint>
+#include <string>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+using std::string;
+
+/**
+watches the config file with inotify and calls back once it settles after a change. the directory is watched rather
+than the file, so editors that save by writing a new file and renaming it over the old one are caught too
+*/
+class ConfigWatcher {
+  public:
+    typedef void (*changed_callback)();
+
+  private:
+    // a save can be several writes and a rename, they are taken as one change once this long has passed without another
+    static constexpr uint64_t SETTLE_MS = 200;
+
+    inline static struct pw_loop *loop = nullptr;
+    inline static struct spa_source *inotify_source = nullptr;
+    inline static struct spa_source *settle_timer = nullptr;
+    inline static string file_name = "";
+    inline static changed_callback on_changed = nullptr;
+
+    static void on_inotify(void *data, int fd, uint32_t mask) {
+        alignas(struct inotify_event) char buffer[4096];
+        bool changed = false;
+        ssize_t length;
+
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (char *next = buffer; next < buffer + length;) {
+                auto *event = (struct inotify_event *)next;
+                next += sizeof(struct inotify_event) + event->len;
+
+                if (event->len && file_name == event->name)
+                    changed = true;
+            }
+        }
+
+        if (!changed)
+            return;
+
+        struct timespec timeout = {0, (long)SETTLE_MS * 1000000};
+        pw_loop_update_timer(loop, settle_timer, &timeout, nullptr, false);
+    }
+
+    static void on_settle_timer(void *data, uint64_t expirations) {
+        Logger::info({.phase = "config"}, "Config file changed, reloading");
+        on_changed();
+    }
+
+  public:
+    static bool start(struct pw_loop *pw_loop, const string &path, changed_callback callback) {
+        size_t separator = path.find_last_of('/');
+        if (path.empty() || separator == string::npos)
+            return false;
+
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        string dir = separator == 0 ? "/" : path.substr(0, separator);
+        if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            close(fd);
+            return false;
+        }
+
+        loop = pw_loop;
+        file_name = path.substr(separator + 1);
+        on_changed = callback;
+
+        inotify_source = pw_loop_add_io(loop, fd, SPA_IO_IN, true, ConfigWatcher::on_inotify, nullptr);
+        settle_timer = pw_loop_add_timer(loop, ConfigWatcher::on_settle_timer, nullptr);
+        return true;
+    }
+
+    static void stop() {
+        if (settle_timer) {
+            pw_loop_destroy_source(loop, settle_timer);
+            settle_timer = nullptr;
+        }
+
+        if (inotify_source) {
+            pw_loop_destroy_source(loop, inotify_source);
+            inotify_source = nullptr;
+        }
+    }
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "clock.hpp"
+#include "logger.hpp"
+#include "pipewire/context.h"
+#include "pipewire/core.h"
+#include "pipewire/keys.h"
+#include "pipewire/loop.h"
+#include "pipewire/properties.h"
+#include "pipewire/proxy.h"
+#include "spa/utils/hook.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <time.h>
+using std::string;
+
+/**
+owns one connection to a pipewire daemon and its registry. a broken connection is torn down and retried with capped
+exponential backoff, every (re)connect ends in a core sync barrier so the owner knows when the registry has delivered
+every existing global. one instance per remote, all of them on the same loop
+*/
+class DaemonConnection {
+  public:
+    // lost is called before the dead core and registry are destroyed, synced once the registry burst is over. both get
+    // the registry data back
+    typedef void (*lost_callback)(void *data);
+    typedef void (*synced_callback)(void *data, bool reconnected);
+
+  private:
+    static constexpr uint64_t FIRST_BACKOFF_MS = 100;
+    static constexpr uint64_t MAX_BACKOFF_MS = 3200;
+
+    struct pw_context *context = nullptr;
+    // empty for the default remote
+    string remote;
+    // the context is the daemon's own, the core is an in-process client of it
+    bool in_process = false;
+    struct pw_loop *loop = nullptr;
+    struct pw_core *core = nullptr;
+    struct pw_registry *registry = nullptr;
+    struct spa_hook core_listener = {};
+    struct spa_hook registry_listener = {};
+
+    const struct pw_registry_events *registry_events = nullptr;
+    void *registry_data = nullptr;
+    lost_callback on_lost = nullptr;
+    synced_callback on_synced = nullptr;
+
+    struct spa_source *reconnect_timer = nullptr;
+    uint64_t backoff_ms = FIRST_BACKOFF_MS;
+    uint32_t attempts = 0;
+    uint64_t lost_ns = 0;
+    bool reconnected = false;
+    int sync_seq = 0;
+
+    void arm_reconnect(uint64_t delay_ms) {
+        // a zero timeout disarms the timer, so "now" is one nanosecond
+        struct timespec timeout = {(time_t)(delay_ms / 1000), delay_ms ? (long)(delay_ms % 1000) * 1000000 : 1};
+        pw_loop_update_timer(loop, reconnect_timer, &timeout, nullptr, false);
+    }
+
+    void arm_backoff() {
+        arm_reconnect(backoff_ms);
+        backoff_ms = backoff_ms * 2 > MAX_BACKOFF_MS ? MAX_BACKOFF_MS : backoff_ms * 2;
+    }
+
+    static void on_core_done(void *data, uint32_t id, int seq) {
+        DaemonConnection *self = (DaemonConnection *)data;
+        if (id != PW_ID_CORE || seq != self->sync_seq)
+            return;
+
+        if (self->reconnected) {
+            Logger::info({.phase = "reconnect"}, "Reconnected to PipeWire%s%s in %llu ms after %u attempt(s)",
+                         self->remote.empty() ? "" : " remote ", self->remote.c_str(),
+                         (unsigned long long)((monotonic_ns() - self->lost_ns) / 1000000), self->attempts);
+        }
+
+        bool was_reconnect = self->reconnected;
+        self->attempts = 0;
+        self->backoff_ms = FIRST_BACKOFF_MS;
+        self->lost_ns = 0;
+        self->reconnected = false;
+
+        if (self->on_synced)
+            self->on_synced(self->registry_data, was_reconnect);
+    }
+
+    static void on_core_error(void *data, uint32_t id, int seq, int res, const char *message) {
+        DaemonConnection *self = (DaemonConnection *)data;
+        if (id != PW_ID_CORE || res != -EPIPE) {
+            Logger::error({.node_id = id, .phase = "daemon"}, "PipeWire error on object %u: %s", id,
+                          message ? message : strerror(-res));
+            return;
+        }
+
+        Logger::warning({.phase = "daemon"}, "Lost connection to PipeWire%s%s, reconnecting",
+                        self->remote.empty() ? "" : " remote ", self->remote.c_str());
+        // a daemon that keeps accepting and dropping the connection is retried with backoff. the core can't be
+        // destroyed from inside its own event, the timer tears it down first thing
+        if (self->lost_ns || self->attempts) {
+            self->arm_backoff();
+            return;
+        }
+
+        self->lost_ns = monotonic_ns();
+        self->arm_reconnect(0);
+    }
+
+    void disconnect() {
+        if (!core)
+            return;
+
+        spa_hook_remove(&registry_listener);
+        spa_hook_remove(&core_listener);
+
+        pw_proxy_destroy((struct pw_proxy *)registry);
+        registry = nullptr;
+        pw_core_disconnect(core);
+        core = nullptr;
+    }
+
+    bool connect() {
+        if (in_process) {
+            core = pw_context_connect_self(context, nullptr, 0);
+        } else {
+            struct pw_properties *props =
+                remote.empty() ? nullptr : pw_properties_new(PW_KEY_REMOTE_NAME, remote.c_str(), nullptr);
+            core = pw_context_connect(context, props, 0);
+        }
+
+        if (!core)
+            return false;
+
+        static const struct pw_core_events core_events = {
+            .version = PW_VERSION_CORE_EVENTS,
+            .done = DaemonConnection::on_core_done,
+            .error = DaemonConnection::on_core_error,
+        };
+
+        spa_zero(core_listener);
+        pw_core_add_listener(core, &core_listener, &core_events, this);
+
+        registry = pw_core_get_registry(core, PW_VERSION_REGISTRY, 0);
+        spa_zero(registry_listener);
+        pw_registry_add_listener(registry, &registry_listener, registry_events, registry_data);
+
+        sync_seq = pw_core_sync(core, PW_ID_CORE, sync_seq);
+        return true;
+    }
+
+    static void on_reconnect_timer(void *data, uint64_t expirations) {
+        DaemonConnection *self = (DaemonConnection *)data;
+        if (self->core) {
+            if (self->on_lost)
+                self->on_lost(self->registry_data);
+            self->disconnect();
+        }
+
+        self->attempts++;
+        if (self->connect()) {
+            self->reconnected = true;
+            return;
+        }
+
+        self->arm_backoff();
+    }
+
+  public:
+    DaemonConnection(const string &remote) {
+        this->remote = remote;
+    }
+
+    ~DaemonConnection() {
+        this->stop();
+    }
+
+    DaemonConnection(const DaemonConnection &) = delete;
+    DaemonConnection &operator=(const DaemonConnection &) = delete;
+
+    // with retry, a failed first connect is retried in the background like a lost one instead of failing the start
+    bool start(struct pw_context *pw_context, const struct pw_registry_events *events, void *data, lost_callback lost,
+               synced_callback synced, bool self = false, bool retry = false) {
+        context = pw_context;
+        in_process = self;
+        loop = pw_context_get_main_loop(pw_context);
+        registry_events = events;
+        registry_data = data;
+        on_lost = lost;
+        on_synced = synced;
+
+        reconnect_timer = pw_loop_add_timer(loop, DaemonConnection::on_reconnect_timer, this);
+        if (this->connect())
+            return true;
+        if (!retry)
+            return false;
+
+        Logger::warning({.phase = "daemon"}, "PipeWire remote %s is not up yet, retrying", remote.c_str());
+        lost_ns = monotonic_ns();
+        arm_backoff();
+        return true;
+    }
+
+    void stop() {
+        this->disconnect();
+
+        if (reconnect_timer) {
+            pw_loop_destroy_source(loop, reconnect_timer);
+            reconnect_timer = nullptr;
+        }
+    }
+
+    struct pw_registry *get_registry() {
+        return registry;
+    }
+
+    const string &get_remote() {
+        return remote;
+    }
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+using std::vector;
+
+/**
+open addressing table from pipewire object id to a pointer, linear probing over a power of two array. removed slots
+are left as tombstones so probe chains stay intact, they are dropped whenever the table is rebuilt
+*/
+template <typename T> class IdTable {
+  private:
+    enum slot_state : uint8_t { EMPTY, USED, REMOVED };
+
+    struct slot {
+        uint32_t id;
+        slot_state state;
+        T *value;
+    };
+
+    static constexpr uint32_t MIN_CAPACITY = 64;
+
+    vector<slot> slots = vector<slot>(MIN_CAPACITY, slot{0, EMPTY, nullptr});
+    uint32_t used = 0;
+    uint32_t removed = 0;
+
+    uint32_t home(uint32_t id) const {
+        // fibonacci hashing, consecutive ids land far apart
+        return (uint32_t)((id * 2654435769u) & (this->slots.size() - 1));
+    }
+
+    void rebuild(uint32_t capacity) {
+        vector<slot> old = std::move(this->slots);
+        this->slots.assign(capacity, slot{0, EMPTY, nullptr});
+        this->used = 0;
+        this->removed = 0;
+
+        for (const slot &entry : old) {
+            if (entry.state == USED)
+                this->insert(entry.id, entry.value);
+        }
+    }
+
+  public:
+    T *find(uint32_t id) const {
+        uint32_t mask = this->slots.size() - 1;
+
+        for (uint32_t i = this->home(id);; i = (i + 1) & mask) {
+            const slot &entry = this->slots[i];
+
+            if (entry.state == EMPTY)
+                return nullptr;
+
+            if (entry.state == USED && entry.id == id)
+                return entry.value;
+        }
+    }
+
+    // replaces the value if id is already present
+    void insert(uint32_t id, T *value) {
+        // keep at least a quarter of the slots empty so every probe terminates quickly
+        if ((this->used + this->removed + 1) * 4 > this->slots.size() * 3)
+            this->rebuild((this->used + 1) * 2 > this->slots.size() ? this->slots.size() * 2 : this->slots.size());
+
+        uint32_t mask = this->slots.size() - 1;
+        slot *reuse = nullptr;
+
+        for (uint32_t i = this->home(id);; i = (i + 1) & mask) {
+            slot &entry = this->slots[i];
+
+            if (entry.state == USED && entry.id == id) {
+                entry.value = value;
+                return;
+            }
+
+            if (entry.state == REMOVED && !reuse)
+                reuse = &entry;
+
+            if (entry.state == EMPTY) {
+                if (reuse)
+                    this->removed--;
+                else
+                    reuse = &entry;
+                break;
+            }
+        }
+
+        *reuse = slot{id, USED, value};
+        this->used++;
+    }
+
+    T *erase(uint32_t id) {
+        uint32_t mask = this->slots.size() - 1;
+
+        for (uint32_t i = this->home(id);; i = (i + 1) & mask) {
+            slot &entry = this->slots[i];
+
+            if (entry.state == EMPTY)
+                return nullptr;
+
+            if (entry.state == USED && entry.id == id) {
+                T *value = entry.value;
+                entry = slot{0, REMOVED, nullptr};
+                this->used--;
+                this->removed++;
+                return value;
+            }
+        }
+    }
+
+    vector<uint32_t> ids() const {
+        vector<uint32_t> found;
+
+        for (const slot &entry : this->slots) {
+            if (entry.state == USED)
+                found.push_back(entry.id);
+        }
+
+        return found;
+    }
+
+    uint32_t size() const {
+        return this->used;
+    }
+
+    bool empty() const {
+        return this->used == 0;
+    }
+};
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+using std::atomic;
+using std::string;
+using std::thread;
+
+// debug lines are compiled out unless the build defines PIPETRON_DEBUG_LOG=1, see the debug_log meson option
+#ifndef PIPETRON_DEBUG_LOG
+#define PIPETRON_DEBUG_LOG 0
+#endif
+
+// the arguments aren't even evaluated when debug logging is compiled out
+#define LOG_DEBUG(...)                                                                                                 \
+    do {                                                                                                               \
+        if constexpr (PIPETRON_DEBUG_LOG)                                                                              \
+            Logger::debug(__VA_ARGS__);                                                                                \
+    } while (0)
+
+enum class log_level : uint8_t { DEBUG, INFO, WARNING, ERROR };
+
+// what a line is about, every field is optional
+struct log_fields {
+    uint32_t node_id = UINT32_MAX;
+    const char *app = nullptr;
+    const char *phase = nullptr;
+};
+
+/**
+lines are formatted into a fixed size slot of a lock-free ring and written out by a writer thread, so a slow stdout
+(journald applying back-pressure) never blocks the caller. when the ring is full lines are dropped and counted rather
+than waited for. output is logfmt, one line per entry. an embedder with a log of its own gets the lines handed over
+instead, without the ring or the thread
+*/
+class Logger {
+  public:
+    // one logfmt line without its newline
+    typedef void (*line_sink)(log_level level, const char *line);
+
+  private:
+    static constexpr uint32_t CAPACITY = 1024;
+    static constexpr uint32_t APP_SIZE = 48;
+    static constexpr uint32_t PHASE_SIZE = 16;
+    static constexpr uint32_t MESSAGE_SIZE = 224;
+
+    // bounded multi producer queue slot, sequence tells producers and the writer whose turn the slot is
+    struct entry {
+        atomic<uint64_t> sequence;
+        log_level level;
+        uint32_t node_id;
+        char app[APP_SIZE];
+        char phase[PHASE_SIZE];
+        char message[MESSAGE_SIZE];
+    };
+
+    inline static entry ring[CAPACITY];
+    inline static atomic<uint64_t> enqueue_pos = 0;
+    // only touched by the writer thread
+    inline static uint64_t dequeue_pos = 0;
+    inline static atomic<uint64_t> dropped = 0;
+
+    inline static atomic<log_level> threshold = log_level::INFO;
+    inline static atomic<bool> running = false;
+    inline static atomic<bool> stopping = false;
+    inline static int wake_fd = -1;
+    inline static thread writer;
+    inline static line_sink sink = nullptr;
+
+    static const char *level_name(log_level level) {
+        switch (level) {
+        case log_level::DEBUG:
+            return "debug";
+        case log_level::INFO:
+            return "info";
+        case log_level::WARNING:
+            return "warning";
+        default:
+            return "error";
+        }
+    }
+
+    static void append_quoted(string &line, const char *value) {
+        line += '"';
+        for (const char *c = value; *c; c++) {
+            if (*c == '"' || *c == '\\')
+                line += '\\';
+            line += *c;
+        }
+        line += '"';
+    }
+
+    static void append_line(string &out, log_level level, uint32_t node_id, const char *app, const char *phase,
+                            const char *message) {
+        out += "level=";
+        out += level_name(level);
+
+        if (phase[0] != '\0') {
+            out += " phase=";
+            out += phase;
+        }
+
+        if (node_id != UINT32_MAX)
+            out += " node=" + std::to_string(node_id);
+
+        if (app[0] != '\0') {
+            out += " app=";
+            append_quoted(out, app);
+        }
+
+        out += " msg=";
+        append_quoted(out, message);
+        out += '\n';
+    }
+
+    static void write_all(const string &out) {
+        size_t done = 0;
+
+        while (done < out.size()) {
+            ssize_t written = ::write(STDOUT_FILENO, out.data() + done, out.size() - done);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return;
+
+            done += written;
+        }
+    }
+
+    static void copy_field(char *dest, const char *src, size_t size) {
+        if (!src) {
+            dest[0] = '\0';
+            return;
+        }
+
+        strncpy(dest, src, size - 1);
+        dest[size - 1] = '\0';
+    }
+
+    // formats everything queued so far and writes it with as few syscalls as possible
+    static void drain() {
+        string out = "";
+
+        for (;;) {
+            entry &slot = ring[dequeue_pos % CAPACITY];
+
+            if (slot.sequence.load(std::memory_order_acquire) != dequeue_pos + 1)
+                break;
+
+            append_line(out, slot.level, slot.node_id, slot.app, slot.phase, slot.message);
+
+            slot.sequence.store(dequeue_pos + CAPACITY, std::memory_order_release);
+            dequeue_pos++;
+        }
+
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost)
+            append_line(out, log_level::WARNING, UINT32_MAX, "", "log",
+                        (std::to_string(lost) + " line(s) dropped, log buffer full").c_str());
+
+        if (!out.empty())
+            write_all(out);
+    }
+
+    static void run_writer() {
+        struct pollfd wake = {wake_fd, POLLIN, 0};
+
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (poll(&wake, 1, -1) < 0 && errno != EINTR)
+                break;
+
+            uint64_t count;
+            ssize_t got = read(wake_fd, &count, sizeof(count));
+            (void)got;
+
+            drain();
+        }
+
+        drain();
+    }
+
+    static void vwrite(log_level level, const log_fields &fields, const char *format, va_list args) {
+        if (level < threshold.load(std::memory_order_relaxed))
+            return;
+
+        // before start and after stop lines are written straight away
+        if (sink || !running.load(std::memory_order_acquire)) {
+            char message[MESSAGE_SIZE];
+            vsnprintf(message, sizeof(message), format, args);
+
+            string out = "";
+            append_line(out, level, fields.node_id, fields.app ? fields.app : "", fields.phase ? fields.phase : "",
+                        message);
+
+            if (!sink) {
+                write_all(out);
+                return;
+            }
+
+            out.pop_back();
+            sink(level, out.c_str());
+            return;
+        }
+
+        uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        entry *slot;
+
+        for (;;) {
+            slot = &ring[pos % CAPACITY];
+            int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+
+            if (diff == 0 && enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+
+            if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (diff > 0)
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+
+        slot->level = level;
+        slot->node_id = fields.node_id;
+        copy_field(slot->app, fields.app, APP_SIZE);
+        copy_field(slot->phase, fields.phase, PHASE_SIZE);
+        vsnprintf(slot->message, MESSAGE_SIZE, format, args);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        // nonblocking, a saturated counter just means the writer is already due to wake up
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+
+  public:
+    static bool parse_level(const string &value, log_level &out) {
+        if (value == "debug")
+            out = log_level::DEBUG;
+        else if (value == "info")
+            out = log_level::INFO;
+        else if (value == "warning")
+            out = log_level::WARNING;
+        else if (value == "error")
+            out = log_level::ERROR;
+        else
+            return false;
+
+        return true;
+    }
+
+    static void set_level(log_level level) {
+        threshold.store(level, std::memory_order_relaxed);
+    }
+
+    static void start(line_sink to = nullptr) {
+        sink = to;
+        if (sink)
+            return;
+
+        for (uint32_t i = 0; i < CAPACITY; i++)
+            ring[i].sequence.store(i, std::memory_order_relaxed);
+
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos = 0;
+
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd < 0)
+            return;
+
+        stopping.store(false, std::memory_order_relaxed);
+        writer = thread(Logger::run_writer);
+        running.store(true, std::memory_order_release);
+    }
+
+    // everything queued before the call is written out before it returns
+    static void stop() {
+        sink = nullptr;
+        if (!running.exchange(false, std::memory_order_acq_rel))
+            return;
+
+        stopping.store(true, std::memory_order_release);
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written;
+
+        writer.join();
+        close(wake_fd);
+        wake_fd = -1;
+    }
+
+    __attribute__((format(printf, 2, 3))) static void debug(const log_fields &fields, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        vwrite(log_level::DEBUG, fields, format, args);
+        va_end(args);
+    }
+
+    __attribute__((format(printf, 2, 3))) static void info(const log_fields &fields, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        vwrite(log_level::INFO, fields, format, args);
+        va_end(args);
+    }
+
+    __attribute__((format(printf, 2, 3))) static void warning(const log_fields &fields, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        vwrite(log_level::WARNING, fields, format, args);
+        va_end(args);
+    }
+
+    __attribute__((format(printf, 2, 3))) static void error(const log_fields &fields, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        vwrite(log_level::ERROR, fields, format, args);
+        va_end(args);
+    }
+};
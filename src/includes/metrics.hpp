@@ -0,0 +1,216 @@
+#pragma once
+
+#include "logger.hpp"
+#include "pipewire/loop.h"
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+using std::atomic;
+using std::string;
+using std::to_string;
+
+/**
+in-process counters and latency histograms. updates are relaxed atomics so any thread can record without locking, a
+snapshot is written in prometheus text format to stdout on SIGUSR1 and, if enabled, to every client of a unix socket
+*/
+class Metrics {
+  public:
+    enum counter : uint32_t {
+        NODES_SEEN,
+        NODES_MATCHED,
+        NODES_REPLICATED,
+        PROPS_WRITES,
+        ECHOES_IGNORED,
+        CORRECTIVE_WRITES,
+        // in-app changes written to the vnode in bidirectional mode
+        APP_CHANGES,
+        // daemon events received on onode proxies and vnode streams
+        NODE_EVENTS,
+        COUNTER_COUNT,
+    };
+
+    enum histogram : uint32_t {
+        // registry global added until the onode is synced to its vnode
+        REPLICATION_LATENCY,
+        // vnode Props change until the matching set_param on the onode, rate limiting included
+        PROPS_LATENCY,
+        // set_param on the onode until its echo comes back, the round trip through the daemon
+        ECHO_LATENCY,
+        HISTOGRAM_COUNT,
+    };
+
+  private:
+    // power of two buckets in microseconds, the last one also takes everything above 2^(BUCKET_COUNT - 2) us
+    static constexpr uint32_t BUCKET_COUNT = 24;
+
+    struct histogram_data {
+        atomic<uint64_t> buckets[BUCKET_COUNT];
+        atomic<uint64_t> sum_us;
+        atomic<uint64_t> count;
+    };
+
+    static constexpr const char *COUNTER_NAMES[COUNTER_COUNT] = {
+        "pipetron_nodes_seen_total",   "pipetron_nodes_matched_total",  "pipetron_nodes_replicated_total",
+        "pipetron_props_writes_total", "pipetron_echoes_ignored_total", "pipetron_corrective_writes_total",
+        "pipetron_app_changes_total",  "pipetron_node_events_total",
+    };
+
+    static constexpr const char *HISTOGRAM_NAMES[HISTOGRAM_COUNT] = {
+        "pipetron_replication_latency_us",
+        "pipetron_props_latency_us",
+        "pipetron_echo_latency_us",
+    };
+
+    inline static atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    inline static histogram_data histograms[HISTOGRAM_COUNT] = {};
+
+    inline static struct pw_loop *loop = nullptr;
+    inline static struct spa_source *dump_signal = nullptr;
+    inline static struct spa_source *socket_source = nullptr;
+    inline static string socket_path = "";
+
+    static uint32_t bucket_of(uint64_t value_us) {
+        // smallest bucket whose upper bound holds the value
+        uint32_t bucket = 0;
+
+        while ((1ull << bucket) < value_us && bucket < BUCKET_COUNT - 1)
+            bucket++;
+
+        return bucket;
+    }
+
+    static void on_dump_signal(void *data, int signal_number) {
+        // straight to stdout in one go, the snapshot is multi line and too big for a log entry
+        string text = Metrics::snapshot();
+        ssize_t written = ::write(STDOUT_FILENO, text.c_str(), text.size());
+        (void)written;
+    }
+
+    static void on_socket_client(void *data, int fd, uint32_t mask) {
+        int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            return;
+
+        // a snapshot is a few kB, well within the socket buffer, so a single write doesn't block
+        string text = Metrics::snapshot();
+        ssize_t written = send(client, text.c_str(), text.size(), MSG_NOSIGNAL);
+        (void)written;
+
+        ::close(client);
+    }
+
+    static bool open_socket(const string &path) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+
+        if (path.empty() || path.size() >= sizeof(addr.sun_path))
+            return false;
+
+        string dir = path.substr(0, path.find_last_of('/'));
+        mkdir(dir.c_str(), 0700);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+
+        // a socket left behind by a crashed instance would make bind fail
+        unlink(path.c_str());
+        path.copy(addr.sun_path, path.size());
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        chmod(path.c_str(), 0600);
+        socket_path = path;
+        socket_source = pw_loop_add_io(loop, fd, SPA_IO_IN, true, Metrics::on_socket_client, nullptr);
+        return true;
+    }
+
+  public:
+    static void count(counter which, uint64_t amount = 1) {
+        counters[which].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    static uint64_t get(counter which) {
+        return counters[which].load(std::memory_order_relaxed);
+    }
+
+    static void observe(histogram which, uint64_t duration_ns) {
+        uint64_t value_us = duration_ns / 1000;
+        histogram_data &data = histograms[which];
+
+        data.buckets[bucket_of(value_us)].fetch_add(1, std::memory_order_relaxed);
+        data.sum_us.fetch_add(value_us, std::memory_order_relaxed);
+        data.count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // buckets are cumulative as prometheus expects, every upper bound is inclusive
+    static string snapshot() {
+        string text = "";
+
+        for (uint32_t i = 0; i < COUNTER_COUNT; i++) {
+            text += "# TYPE " + string(COUNTER_NAMES[i]) + " counter\n";
+            text += string(COUNTER_NAMES[i]) + " " + to_string(counters[i].load(std::memory_order_relaxed)) + "\n";
+        }
+
+        for (uint32_t i = 0; i < HISTOGRAM_COUNT; i++) {
+            const string name = HISTOGRAM_NAMES[i];
+            const histogram_data &data = histograms[i];
+            uint64_t cumulative = 0;
+
+            text += "# TYPE " + name + " histogram\n";
+            for (uint32_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+                cumulative += data.buckets[bucket].load(std::memory_order_relaxed);
+
+                string bound = bucket == BUCKET_COUNT - 1 ? "+Inf" : to_string(1ull << bucket);
+                text += name + "_bucket{le=\"" + bound + "\"} " + to_string(cumulative) + "\n";
+            }
+
+            text += name + "_sum " + to_string(data.sum_us.load(std::memory_order_relaxed)) + "\n";
+            text += name + "_count " + to_string(data.count.load(std::memory_order_relaxed)) + "\n";
+        }
+
+        return text;
+    }
+
+    static string default_socket_path() {
+        const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+        if (runtime_dir && runtime_dir[0] != '\0')
+            return string(runtime_dir) + "/pipetron/metrics.sock";
+
+        return "";
+    }
+
+    // SIGUSR1 dumps to stdout unless the process isn't ours to take signals in, the socket is only opened when a
+    // path is given
+    static void start(struct pw_loop *pw_loop, const string &path, bool dump_on_signal) {
+        loop = pw_loop;
+        if (dump_on_signal)
+            dump_signal = pw_loop_add_signal(loop, SIGUSR1, Metrics::on_dump_signal, nullptr);
+
+        if (!path.empty() && !Metrics::open_socket(path))
+            Logger::warning({.phase = "metrics"}, "Metrics socket unavailable at %s", path.c_str());
+    }
+
+    static void stop() {
+        if (dump_signal) {
+            pw_loop_destroy_source(loop, dump_signal);
+            dump_signal = nullptr;
+        }
+
+        if (socket_source) {
+            pw_loop_destroy_source(loop, socket_source);
+            socket_source = nullptr;
+            unlink(socket_path.c_str());
+        }
+    }
+};
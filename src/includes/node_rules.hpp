@@ -0,0 +1,157 @@
+#pragma once
+
+#include "spa/utils/dict.h"
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fnmatch.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+using std::deque;
+using std::istringstream;
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+struct node_rule {
+    enum match_type { EXACT, PREFIX, GLOB };
+    enum policy_type { REPLICATE, IGNORE };
+
+    policy_type policy;
+    match_type match;
+    string key;
+    string pattern;
+
+    node_rule(policy_type policy, match_type match, const string &key, const string &pattern)
+        : policy(policy), match(match), key(key), pattern(pattern) {
+    }
+
+    bool operator==(const node_rule &other) const {
+        return policy == other.policy && match == other.match && key == other.key && pattern == other.pattern;
+    }
+
+    // "<replicate|ignore> <exact|prefix|glob> <key> <pattern>", the pattern is the rest of the line
+    static bool parse(const string &line, vector<node_rule> &rules) {
+        istringstream stream(line);
+        string policy, match, key, pattern;
+
+        if (!(stream >> policy >> match >> key))
+            return false;
+
+        getline(stream >> std::ws, pattern);
+        if (pattern.empty())
+            return false;
+
+        policy_type parsed_policy;
+        if (policy == "replicate")
+            parsed_policy = REPLICATE;
+        else if (policy == "ignore")
+            parsed_policy = IGNORE;
+        else
+            return false;
+
+        match_type parsed_match;
+        if (match == "exact")
+            parsed_match = EXACT;
+        else if (match == "prefix")
+            parsed_match = PREFIX;
+        else if (match == "glob")
+            parsed_match = GLOB;
+        else
+            return false;
+
+        rules.emplace_back(parsed_policy, parsed_match, key, pattern);
+        return true;
+    }
+};
+
+/**
+rules are compiled once into a table from interned prop key to the rules testing it, so a registry global is matched
+with one hash lookup per prop and no allocation. the first rule in config order that matches decides the policy
+*/
+class NodeRules {
+  private:
+    struct compiled_rule {
+        node_rule::policy_type policy;
+        node_rule::match_type match;
+        string pattern;
+    };
+
+    inline static vector<compiled_rule> rules = {};
+
+    // key strings are kept in a deque so the views used as map keys stay valid
+    inline static deque<string> interned_keys = {};
+    inline static unordered_map<string_view, vector<uint32_t>> rules_by_key = {};
+
+    static bool matches(const compiled_rule &rule, const char *value) {
+        switch (rule.match) {
+        case node_rule::EXACT:
+            return strcmp(value, rule.pattern.c_str()) == 0;
+        case node_rule::PREFIX:
+            return strncmp(value, rule.pattern.c_str(), rule.pattern.size()) == 0;
+        case node_rule::GLOB:
+            return fnmatch(rule.pattern.c_str(), value, 0) == 0;
+        }
+
+        return false;
+    }
+
+  public:
+    static vector<node_rule> default_rules() {
+        return {
+            node_rule(node_rule::REPLICATE, node_rule::EXACT, "application.name", "Chromium"),
+            node_rule(node_rule::REPLICATE, node_rule::EXACT, "application.name", "Chromium input"),
+        };
+    }
+
+    static void compile(const vector<node_rule> &config_rules) {
+        rules.clear();
+        rules_by_key.clear();
+        interned_keys.clear();
+
+        for (const node_rule &rule : config_rules) {
+            auto it = rules_by_key.find(rule.key);
+
+            if (it == rules_by_key.end()) {
+                interned_keys.push_back(rule.key);
+                it = rules_by_key.emplace(interned_keys.back(), vector<uint32_t>()).first;
+            }
+
+            it->second.push_back(rules.size());
+            rules.push_back({rule.policy, rule.match, rule.pattern});
+        }
+    }
+
+    // policy of the first matching rule, nodes no rule matches are ignored
+    static node_rule::policy_type match(const struct spa_dict *props) {
+        uint32_t first_match = UINT32_MAX;
+
+        if (!props)
+            return node_rule::IGNORE;
+
+        for (uint32_t i = 0; i < props->n_items; i++) {
+            if (!props->items[i].key || !props->items[i].value)
+                continue;
+
+            auto it = rules_by_key.find(string_view(props->items[i].key));
+            if (it == rules_by_key.end())
+                continue;
+
+            for (uint32_t rule_index : it->second) {
+                if (rule_index >= first_match)
+                    break;
+
+                if (matches(rules[rule_index], props->items[i].value)) {
+                    first_match = rule_index;
+                    break;
+                }
+            }
+        }
+
+        return first_match == UINT32_MAX ? node_rule::IGNORE : rules[first_match].policy;
+    }
+};
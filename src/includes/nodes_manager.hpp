@@ -1,31 +1,46 @@
+#include "app_resolver.hpp"
+#include "backend.hpp"
+#include "clock.hpp"
+#include "config.hpp"
+#include "id_table.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
 #include "pipewire/context.h"
 #include "pipewire/core.h"
 #include "pipewire/keys.h"
+#include "pipewire/loop.h"
 #include "pipewire/node.h"
 #include "pipewire/properties.h"
 #include "pipewire/proxy.h"
 #include "pipewire/stream.h"
+#include "probes.hpp"
+#include "props_state.hpp"
+#include "slab_pool.hpp"
 #include "spa/param/param.h"
 #include "spa/pod/builder.h"
 #include "spa/utils/dict.h"
 #include "spa/utils/hook.h"
+#include "sync_loop.hpp"
+#include "volume_cache.hpp"
+#include <algorithm>
 #include <any>
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <functional>
-#include <iostream>
-#include <ostream>
 #include <queue>
 #include <spa/param/audio/format-utils.h>
 #include <spa/pod/compare.h>
 #include <string>
 #include <tuple>
+#include <time.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 using std::any;
 using std::any_cast;
-using std::cout;
-using std::endl;
+using std::deque;
 using std::function;
 using std::make_tuple;
 using std::queue;
@@ -33,623 +48,1958 @@ using std::string;
 using std::to_string;
 using std::tuple;
 using std::unordered_map;
+using std::unordered_multimap;
+using std::unordered_set;
 using std::vector;
 
 namespace {
+/**
+the onodes, vnodes and app connections of one pipewire remote. each remote served has its own instance, records and
+vnodes point back to the one that owns them. replicated node counts and the stats timer are process wide
+*/
 class Stores {
   public:
+    // set on every vnode stream, so pipetron's own nodes can be told apart in the registry
+    static constexpr const char *REPLICA_KEY = "pipetron.replica";
+
     struct sync_params_data {
-        struct pw_node *vnode;
-        struct pw_registry *vnode_reg;
+        // echoes carry no write seq, they are matched by value and confirm every older write with them
+        struct pending_write {
+            uint64_t time_ns;
+            uint32_t fields;
+            props_state props;
+        };
+
+        // writes not echoed within this window are assumed lost or merged into a later event
+        static constexpr uint64_t PENDING_WRITE_TIMEOUT_NS = 1000000000ull;
+
         struct pw_node *onode;
-        bool ignore_next_onode_event;
-        spa_pod *param_data;
-        vector<spa_hook *> listeners;
+        deque<pending_write> pending_writes;
+        props_state vnode_props;
+        props_state onode_props;
+        spa_hook listener;
+
+        // coalesces vnode Props bursts into at most Config::props_max_rate_hz writes to the onode
+        struct pw_loop *loop;
+        struct spa_source *flush_timer;
+        // rechecks the onode once the outstanding writes time out
+        struct spa_source *recheck_timer;
+        bool flush_pending;
+        uint64_t last_flush_ns;
+        uint64_t vnode_change_ns;
 
         sync_params_data() {
-            this->vnode = nullptr;
             this->onode = nullptr;
-            this->vnode_reg = nullptr;
-            this->param_data = nullptr;
-            this->ignore_next_onode_event = true;
-            this->listeners = {};
+            this->loop = nullptr;
+            this->flush_timer = nullptr;
+            this->recheck_timer = nullptr;
+            this->flush_pending = false;
+            this->last_flush_ns = 0;
+            this->vnode_change_ns = 0;
+            spa_zero(this->listener);
         }
 
         ~sync_params_data() {
-            for (spa_hook *listener : this->listeners) {
-                if (listener) {
-                    spa_hook_remove(listener);
-                    delete listener;
-                    listener = nullptr;
-                }
-            }
-            this->listeners.clear();
+            this->reset();
+        }
 
-            if (this->vnode) {
-                pw_proxy_destroy((pw_proxy *)this->vnode);
-                this->vnode = nullptr;
+        // drops everything tied to the onode proxy, what is known about the vnode side is kept
+        void reset() {
+            if (this->flush_timer) {
+                pw_loop_destroy_source(this->loop, this->flush_timer);
+                this->flush_timer = nullptr;
             }
+            if (this->recheck_timer) {
+                pw_loop_destroy_source(this->loop, this->recheck_timer);
+                this->recheck_timer = nullptr;
+            }
+            this->flush_pending = false;
+
+            Stores::unhook(this->listener);
 
             if (this->onode) {
-                pw_proxy_destroy((pw_proxy *)this->onode);
+                Backend::get().destroy_proxy((pw_proxy *)this->onode);
                 this->onode = nullptr;
             }
 
-            if (this->vnode_reg) {
-                pw_proxy_destroy((pw_proxy *)this->vnode_reg);
-                this->vnode_reg = nullptr;
-            }
-
-            if (this->param_data) {
-                free(this->param_data);
-                this->param_data = nullptr;
-            }
+            this->pending_writes.clear();
+            this->onode_props = props_state();
         }
     };
 
     struct onode_info {
         const uint32_t id;
+        // object.serial of the registry global, tells a rebound onode from a new one reusing its id
+        string serial;
+        uint32_t app_process_id;
         string app_process_binary;
+        string app_name;
+        string app_icon;
         string media_class;
         string media_name;
         spa_audio_info_raw audio_info;
 
         onode_info(uint32_t id) : id(id) {
+            this->app_process_id = 0;
             this->audio_info = {};
         }
     };
 
-  private:
+    struct virtual_node_data;
+    struct app_connection;
+
+    /**
+    lifecycle of an onode: BINDING until its first info, INFO_READY until its Format, FORMAT_READY while its app name
+    is resolved, it waits for its group's vnode or, with lazy replication, for the onode to run, STREAM_CONNECTING while
+    its own vnode stream comes up, SYNCING once it is a member of a vnode, and CLOSING while it is torn down, so
+    callbacks fired by the teardown itself are ignored. a lazily replicated onode that stays idle goes back from SYNCING
+    to FORMAT_READY
+    */
+    enum class onode_state { BINDING, INFO_READY, FORMAT_READY, STREAM_CONNECTING, SYNCING, CLOSING };
+
+    // everything kept for one onode in a single pool slot, the hooks are embedded so nothing outlives the record
+    struct onode_record {
+        onode_state state;
+        onode_info info;
+        sync_params_data sync;
+        virtual_node_data *vnode;
+        Stores *owner;
+
+        bool has_format;
+        uint64_t resolve_tag;
+        uint64_t added_ns;
+        // the vnode stream and its connection until it reaches PAUSED
+        pw_stream *pending_stream;
+        app_connection *pending_connection;
+        // armed on the sync loop once the vnode stream failed, and again to retry after the backoff
+        struct spa_source *retry_timer;
+        uint32_t failures;
+        // carries info and Format, the same proxy as sync.onode without the sync thread
+        struct pw_node *watch;
+        uint32_t events;
+
+        enum pw_node_state node_state;
+        bool deferred;
+        bool retired;
+        struct pw_loop *idle_loop;
+        struct spa_source *idle_timer;
+
+        spa_hook onode_listener;
+        spa_hook stream_listener;
+
+        onode_record(uint32_t id) : info(id) {
+            this->state = onode_state::BINDING;
+            this->vnode = nullptr;
+            this->owner = nullptr;
+            this->has_format = false;
+            this->resolve_tag = 0;
+            this->added_ns = 0;
+            this->pending_stream = nullptr;
+            this->pending_connection = nullptr;
+            this->retry_timer = nullptr;
+            this->failures = 0;
+            this->watch = nullptr;
+            this->events = 0;
+            this->node_state = PW_NODE_STATE_CREATING;
+            this->deferred = false;
+            this->retired = false;
+            this->idle_loop = nullptr;
+            this->idle_timer = nullptr;
+            spa_zero(this->onode_listener);
+            spa_zero(this->stream_listener);
+        }
+    };
+
+    // a replicated node, synced to one onode or to every onode of its group in aggregate mode
     struct virtual_node_data {
+        Stores *owner;
         uint32_t id;
-        pw_context *context;
-        pw_core *core;
+        string app_name;
+        app_connection *connection;
+        string group_key;
         pw_stream *stream;
-
-        virtual_node_data(uint32_t id, pw_context *context, pw_core *core, pw_stream *stream) {
+        spa_hook listener;
+        bool scheduled;
+        props_state props;
+        vector<onode_record *> members;
+        // set while pipetron writes Props into the stream, so their param_changed is ignored
+        bool writing;
+        uint32_t events;
+
+        virtual_node_data(Stores *owner, uint32_t id, const string &app_name, app_connection *connection,
+                          pw_stream *stream) {
+            this->owner = owner;
             this->id = id;
-            this->context = context;
-            this->core = core;
+            this->app_name = app_name;
+            this->connection = connection;
+            this->group_key = "";
             this->stream = stream;
+            this->scheduled = false;
+            this->members = {};
+            this->writing = false;
+            this->events = 0;
+            spa_zero(this->listener);
+            Stores::vnode_count++;
         }
 
         ~virtual_node_data() {
+            if (this->scheduled)
+                Stores::set_vnode_scheduled(*this, false);
+
+            Stores::unhook(this->listener);
+
             if (this->stream) {
-                pw_stream_destroy(this->stream);
+                Backend::get().destroy_stream(this->stream);
                 this->stream = nullptr;
             }
 
-            if (this->core) {
-                pw_core_disconnect(this->core);
-                this->core = nullptr;
+            Stores::vnode_count--;
+            this->owner->release_app_connection(this->connection);
+        }
+    };
+
+    enum class group_join { CREATE, JOINED, WAITING };
+
+    // one client connection per app, shared by its vnodes
+    struct app_connection {
+        string app_name;
+        pw_loop *loop;
+        pw_context *context;
+        pw_core *core;
+        uint32_t refs;
+        bool broken;
+        spa_hook core_listener;
+
+        app_connection(pw_loop *loop, const string &app_name, const string &remote) {
+            this->app_name = app_name;
+            this->loop = loop;
+            this->context = nullptr;
+            this->core = Backend::get().connect_app(loop, app_name.c_str(), remote.c_str(), &this->context);
+            this->refs = 0;
+            this->broken = false;
+            spa_zero(this->core_listener);
+
+            if (!this->core)
+                return;
+
+            static const struct pw_core_events core_events = {
+                .version = PW_VERSION_CORE_EVENTS,
+                .error = Stores::on_app_core_error,
+            };
+
+            Backend::get().add_core_listener(this->core, &this->core_listener, &core_events, this);
+        }
+
+        ~app_connection() {
+            Stores::unhook(this->core_listener);
+
+            Backend::get().disconnect_app(this->context, this->core);
+            this->core = nullptr;
+            this->context = nullptr;
+        }
+    };
+
+  private:
+    // released vnode kept alive for the grace period so the next matching onode can take it over
+    struct parked_vnode {
+        string pool_key;
+        virtual_node_data *vnode;
+        struct pw_loop *loop;
+        struct spa_source *expiry_timer;
+
+        parked_vnode(const string &pool_key, virtual_node_data *vnode) {
+            this->pool_key = pool_key;
+            this->vnode = vnode;
+            this->loop = vnode->connection->loop;
+            this->expiry_timer = pw_loop_add_timer(this->loop, Stores::on_parked_vnode_expired, this);
+
+            struct timespec timeout = {(time_t)(Config::vnode_grace_period_ms / 1000),
+                                       (long)(Config::vnode_grace_period_ms % 1000) * 1000000};
+            pw_loop_update_timer(this->loop, this->expiry_timer, &timeout, nullptr, false);
+        }
+
+        ~parked_vnode() {
+            if (this->expiry_timer) {
+                pw_loop_destroy_source(this->loop, this->expiry_timer);
+                this->expiry_timer = nullptr;
             }
 
-            if (this->context) {
-                pw_context_destroy(this->context);
-                this->context = nullptr;
+            if (this->vnode) {
+                delete this->vnode;
+                this->vnode = nullptr;
             }
         }
     };
 
-    inline static unordered_map<uint32_t, Stores::onode_info *> onode_infos = {};
-    inline static unordered_map<uint32_t, Stores::virtual_node_data *> onode_to_vnode = {};
-    inline static unordered_map<uint32_t, Stores::sync_params_data *> onode_to_sync_data = {};
+  public:
+    // globals matched before the first sync barrier, bound and queried together once the registry burst is over
+    struct startup_global {
+        uint32_t id;
+        string type;
+        string serial;
+        uint64_t added_ns;
+    };
+
+    // work posted to the sync thread, the record is looked up again there in case it was closed meanwhile
+    struct onode_request {
+        Stores *stores;
+        onode_record *record;
+        uint32_t onode_id;
+    };
+
+    const uint32_t id;
+    const string name;
 
-    template <typename T>
-    static void remove_entry_with_onode(uint32_t onode_id, unordered_map<uint32_t, T *> &map) {
-        auto it = map.find(onode_id);
+    bool startup_burst;
+    vector<startup_global> startup_batch;
+    pw_registry *startup_registry;
 
-        if (it != map.end()) {
-            delete map.at(it->first);
-            it->second = nullptr;
-            map.erase(it);
-        }
-    }
+    // onodes replicated before the daemon connection was lost, waiting for the new registry to show them again
+    unordered_set<uint32_t> remembered_onodes;
+    uint32_t rebound_onodes;
+
+  private:
+    unordered_set<uint32_t> startup_pending;
+    uint32_t startup_replicated;
+    uint64_t startup_begin_ns;
+
+    unordered_map<string, Stores::app_connection *> app_connections;
+    unordered_multimap<string, Stores::parked_vnode *> parked_vnodes;
+
+    SlabPool<onode_record> record_pool;
+    IdTable<onode_record> onode_records;
+
+    // aggregate mode: nullptr while a group's vnode is being created
+    unordered_map<string, Stores::virtual_node_data *> vnode_groups;
+    unordered_map<string, vector<uint32_t>> group_waiters;
+
+    inline static uint32_t vnode_count = 0;
+    inline static uint32_t scheduled_vnodes = 0;
+
+    inline static uint32_t corrective_writes = 0;
+    inline static struct pw_loop *stats_loop = nullptr;
+    inline static struct spa_source *stats_timer = nullptr;
+
+    void release_app_connection(app_connection *connection) {
+        if (--connection->refs > 0)
+            return;
 
-    static void log(string msg) {
-        cout << msg << endl;
+        const string &app_name = connection->app_name;
+        Logger::info({.app = app_name.c_str(), .phase = "connection"}, "Closing connection for %s", app_name.c_str());
+
+        auto it = this->app_connections.find(app_name);
+        if (it != this->app_connections.end() && it->second == connection)
+            this->app_connections.erase(it);
+
+        delete connection;
     }
 
-    static bool get_onode_binary_name(uint32_t onode_id, string &name) {
-        auto it = onode_infos.find(onode_id);
+    // streams are only interchangeable if they look the same to the session manager and negotiate the same format
+    static string vnode_pool_key(const onode_info &onode) {
+        string key = onode.app_name + "\n" + onode.media_class + "\n" +
+                     to_string(onode.audio_info.format) + ":" + to_string(onode.audio_info.rate) + ":" +
+                     to_string(onode.audio_info.channels);
 
-        if (it == onode_infos.end())
-            return false;
+        for (uint32_t i = 0; i < onode.audio_info.channels && i < SPA_AUDIO_MAX_CHANNELS; i++)
+            key += ":" + to_string(onode.audio_info.position[i]);
 
-        name = it->second->app_process_binary;
-        return true;
+        return key;
     }
 
-  public:
-    static const virtual_node_data &get_vnode(uint32_t onode_id) {
-        return *onode_to_vnode.at(onode_id);
+    static string vnode_group_key(const onode_info &onode) {
+        return onode.app_name + "\n" + onode.media_class;
+    }
+
+    static void on_app_core_error(void *data, uint32_t id, int seq, int res, const char *message) {
+        auto *connection = (app_connection *)data;
+
+        if (id == PW_ID_CORE && res == -EPIPE)
+            connection->broken = true;
     }
 
-    static const void set_vnode(uint32_t onode_id, uint32_t vnode_id, pw_context *context, pw_core *core,
-                                pw_stream *stream) {
+    static void on_parked_vnode_expired(void *data, uint64_t expirations) {
+        auto *parked = (parked_vnode *)data;
+        Stores &stores = *parked->vnode->owner;
+        auto range = stores.parked_vnodes.equal_range(parked->pool_key);
 
-        onode_to_vnode.emplace(onode_id, new virtual_node_data(vnode_id, context, core, stream));
+        for (auto it = range.first; it != range.second; it++) {
+            if (it->second != parked)
+                continue;
 
-        string onode_name = "";
-        if (get_onode_binary_name(onode_id, onode_name)) {
-            log("Creating replicated node ID " + to_string(vnode_id) + " for node ID " + to_string(onode_id) + " (" +
-                onode_name + ")");
+            Logger::info({.app = parked->vnode->app_name.c_str(), .phase = "park"},
+                         "Removing unused replicated node ID %u", parked->vnode->id);
+            stores.parked_vnodes.erase(it);
+            delete parked;
+            return;
         }
     }
 
-    static void remove_vnode_entry(uint32_t onode_id) {
-        remove_entry_with_onode<virtual_node_data>(onode_id, onode_to_vnode);
+    static void attach_vnode(onode_record &record, virtual_node_data *vnode) {
+        record.vnode = vnode;
+        vnode->members.push_back(&record);
     }
 
-    static const onode_info &get_onode_info(uint32_t onode_id) {
-        return *onode_infos.at(onode_id);
-    }
+    void detach_vnode(onode_record &record) {
+        virtual_node_data *vnode = record.vnode;
+
+        if (!vnode)
+            return;
 
-    static onode_info &modify_onode_info_entry(uint32_t onode_id) {
+        record.vnode = nullptr;
 
-        if (onode_infos.find(onode_id) == onode_infos.end()) {
-            onode_infos[onode_id] = new onode_info(onode_id);
-            log("New pipewire node ID " + to_string(onode_id) + " detected");
+        for (auto it = vnode->members.begin(); it != vnode->members.end(); it++) {
+            if (*it == &record) {
+                vnode->members.erase(it);
+                break;
+            }
         }
 
-        return *onode_infos[onode_id];
-    }
+        if (!vnode->members.empty())
+            return;
 
-    static void remove_onode_info_entry(uint32_t onode_id) {
-        remove_entry_with_onode<onode_info>(onode_id, onode_infos);
-    }
+        if (!vnode->group_key.empty()) {
+            this->vnode_groups.erase(vnode->group_key);
+            vnode->group_key = "";
+        }
 
-    static sync_params_data &modify_sync_data_entry(uint32_t onode_id) {
-        if (onode_to_sync_data.find(onode_id) == onode_to_sync_data.end()) {
-            onode_to_sync_data[onode_id] = new sync_params_data();
+        if (Config::vnode_grace_period_ms == 0 || vnode->connection->broken) {
+            delete vnode;
+            return;
         }
 
-        return *onode_to_sync_data[onode_id];
+        Logger::info({record.info.id, vnode->app_name.c_str(), "park"}, "Keeping replicated node ID %u for reuse (%s)",
+                     vnode->id, vnode->app_name.c_str());
+
+        string pool_key = vnode_pool_key(record.info);
+        this->parked_vnodes.emplace(pool_key, new parked_vnode(pool_key, vnode));
     }
 
-    static void remove_sync_data_entry(uint32_t onode_id) {
-        remove_entry_with_onode<sync_params_data>(onode_id, onode_to_sync_data);
+    void register_vnode_group(onode_record &record, virtual_node_data *vnode) {
+        if (!Config::vnode_aggregate)
+            return;
+
+        vnode->group_key = vnode_group_key(record.info);
+        this->vnode_groups[vnode->group_key] = vnode;
     }
 
-    static void cleanup_entries_with_onode_id(uint32_t onode_id) {
+    vector<uint32_t> abandon_vnode_group(const onode_record &record) {
+        if (!Config::vnode_aggregate)
+            return {};
+
+        string group_key = vnode_group_key(record.info);
+        auto it = this->vnode_groups.find(group_key);
+
+        if (it == this->vnode_groups.end() || it->second)
+            return {};
+
+        this->vnode_groups.erase(it);
 
-        string onode_name = "";
-        if (get_onode_binary_name(onode_id, onode_name)) {
-            log("Cleaning up node ID " + to_string(onode_id) + " (" + onode_name + ")");
+        vector<uint32_t> waiters = {};
+        auto waiters_it = this->group_waiters.find(group_key);
+        if (waiters_it != this->group_waiters.end()) {
+            waiters = waiters_it->second;
+            this->group_waiters.erase(waiters_it);
         }
 
-        Stores::remove_vnode_entry(onode_id);
-        Stores::remove_sync_data_entry(onode_id);
-        Stores::remove_onode_info_entry(onode_id);
+        return waiters;
     }
 
-    static void cleanup() {
-        for (const auto &[key, value] : onode_infos)
-            remove_entry_with_onode(key, onode_infos);
+    // hooks come off before anything they point into is destroyed
+    void release_onode(onode_record &record) {
+        record.state = onode_state::CLOSING;
+
+        Stores::unhook(record.onode_listener);
+        Stores::unhook(record.stream_listener);
+        Stores::stop_idle_timer(record);
 
-        for (const auto &[key, value] : onode_to_vnode)
-            remove_entry_with_onode(key, onode_to_vnode);
+        Stores::stop_retry_timer(record);
+        this->drop_pending_stream(record);
 
-        for (const auto &[key, value] : onode_to_sync_data)
-            remove_entry_with_onode(key, onode_to_sync_data);
+        Stores::drop_watch(record);
+        record.sync.reset();
+
+        this->onode_records.erase(record.info.id);
+        this->record_pool.destroy(&record);
     }
-};
 
-class ArgStructs {
   public:
-    /**
-    topology: virtual_node_args > state_change_args > state_change_callback_args + state_change_hook_args
-    */
-    struct virtual_node_args {
+    static void unhook(spa_hook &hook) {
+        if (!hook.link.next)
+            return;
+
+        spa_hook_remove(&hook);
+        spa_zero(hook);
+    }
 
-        // structs
-        struct state_change_args {
+    static void drop_watch(onode_record &record) {
+        Stores::unhook(record.onode_listener);
 
-            // structs
-            struct state_change_hook_args {
+        if (record.watch && record.watch != record.sync.onode)
+            Backend::get().destroy_proxy((pw_proxy *)record.watch);
 
-                // properties
-                const uint32_t &onode_id;
-                const uint32_t &vnode_id;
+        record.watch = nullptr;
+    }
 
-                state_change_hook_args(const uint32_t &onode_id, const uint32_t &vnode_id)
-                    : onode_id(onode_id), vnode_id(vnode_id) {
-                }
-            };
+    static void stop_retry_timer(onode_record &record) {
+        if (!record.retry_timer)
+            return;
 
-            struct state_change_callback_args {
-                // properties
-                uint32_t &vnode_id;
-                bool stream_processed_flag;
-                const uint32_t &onode_id;
-                spa_hook *self_listener;
-
-                // contains references from initialise
-                struct pw_context *context;
-                struct pw_core *core;
-                struct pw_stream *stream;
-
-                state_change_callback_args(const uint32_t &onode_id, uint32_t &vnode_id, spa_hook *listener)
-                    : vnode_id(vnode_id), onode_id(onode_id) {
-                    this->stream_processed_flag = false;
-                    this->self_listener = listener;
-                    this->context = nullptr;
-                    this->core = nullptr;
-                    this->stream = nullptr;
-                }
+        pw_loop_destroy_source(record.sync.loop, record.retry_timer);
+        record.retry_timer = nullptr;
+    }
 
-                void initialise(pw_context &vcontext, pw_core &vcore, pw_stream &vstream) {
-                    this->context = &vcontext;
-                    this->core = &vcore;
-                    this->stream = &vstream;
-                }
+    // a connect that failed leaves no stream, only the connection reference is released
+    void drop_pending_stream(onode_record &record) {
+        Stores::unhook(record.stream_listener);
 
-                ~state_change_callback_args() {
-                    if (this->self_listener) {
-                        spa_hook_remove(this->self_listener);
-                        delete this->self_listener;
-                        this->self_listener = nullptr;
-                    }
-                }
-            };
+        if (record.pending_stream) {
+            Backend::get().destroy_stream(record.pending_stream);
+            record.pending_stream = nullptr;
+        }
 
-            // properties
-            state_change_callback_args *callback_args;
-            state_change_hook_args *hook_args;
+        if (record.pending_connection) {
+            release_app_connection(record.pending_connection);
+            record.pending_connection = nullptr;
+        }
+    }
 
-            state_change_args(state_change_callback_args *callback_args, state_change_hook_args *hook_args) {
-                this->callback_args = callback_args;
-                this->hook_args = hook_args;
-            }
+    static void stop_idle_timer(onode_record &record) {
+        if (!record.idle_timer)
+            return;
 
-            ~state_change_args() {
-                if (this->hook_args) {
-                    delete this->hook_args;
-                    this->hook_args = nullptr;
-                }
+        pw_loop_destroy_source(record.idle_loop, record.idle_timer);
+        record.idle_timer = nullptr;
+    }
 
-                if (this->callback_args) {
-                    delete this->callback_args;
-                    this->callback_args = nullptr;
-                }
-            }
-        };
+    // only on the sync thread, the first bind after a reconnect connects the sync registry
+    static bool bind_sync_proxy(onode_record &record) {
+        if (record.sync.onode)
+            return true;
 
-        // properties
-        struct pw_loop &loop;
-        const Stores::onode_info &onode;
-        uint32_t vnode_id;
-        void (*state_change_callback)(void *, enum pw_stream_state, enum pw_stream_state, const char *);
-        state_change_args *state_change_args;
+        pw_registry *sync_reg = SyncLoop::get_registry();
+        if (sync_reg)
+            record.sync.onode = Backend::get().bind_node(sync_reg, record.info.id, PW_TYPE_INTERFACE_Node);
 
-        virtual_node_args(struct pw_loop &loop, const Stores::onode_info &onode,
-                          void (*state_change_callback)(void *, enum pw_stream_state, enum pw_stream_state,
-                                                        const char *))
-            : loop(loop), onode(onode), state_change_callback(state_change_callback) {
-            this->vnode_id = 0;
+        return record.sync.onode != nullptr;
+    }
 
-            this->state_change_args = new struct state_change_args(
-                new state_change_args::state_change_callback_args(this->onode.id, this->vnode_id, new spa_hook()),
-                new state_change_args::state_change_hook_args(this->onode.id, this->vnode_id));
-        }
+    // nullptr if the app couldn't connect
+    app_connection *acquire_app_connection(struct pw_loop &loop, const string &app_name) {
+        auto it = this->app_connections.find(app_name);
 
-        ~virtual_node_args() {
-            if (this->state_change_args) {
-                delete this->state_change_args;
-                this->state_change_args = nullptr;
-            }
+        if (it != this->app_connections.end() && it->second->broken) {
+            Logger::info({.app = app_name.c_str(), .phase = "connection"}, "Replacing broken connection for %s",
+                         app_name.c_str());
+            this->app_connections.erase(it);
+            it = this->app_connections.end();
         }
-    };
 
-    struct process_onode_info_args {
-        Stores::onode_info &onode;
-        bool info_flag;
-        bool params_flag;
+        if (it == this->app_connections.end()) {
+            app_connection *connection = new app_connection(&loop, app_name, this->name);
 
-        spa_hook *self_listener;
+            if (!connection->core) {
+                Logger::error({.app = app_name.c_str(), .phase = "connection"}, "Couldn't open connection for %s",
+                              app_name.c_str());
+                delete connection;
+                return nullptr;
+            }
 
-        process_onode_info_args(Stores::onode_info &onode_info, spa_hook *listener) : onode(onode_info) {
-            this->self_listener = listener;
-            this->info_flag = false;
-            this->params_flag = false;
+            it = this->app_connections.emplace(app_name, connection).first;
+            Logger::info({.app = app_name.c_str(), .phase = "connection"}, "Opening connection for %s",
+                         app_name.c_str());
         }
 
-        ~process_onode_info_args() {
-            if (this->self_listener) {
-                spa_hook_remove(this->self_listener);
-                delete this->self_listener;
-                this->self_listener = nullptr;
-            }
-        }
-    };
-};
+        it->second->refs++;
+        return it->second;
+    }
 
-class EventListeners {
-  public:
-    // for syncing params between vnode and onode
+    void set_vnode(onode_record &record, uint32_t vnode_id, const string &app_name, app_connection *connection,
+                   pw_stream *stream) {
+        virtual_node_data *vnode = new virtual_node_data(this, vnode_id, app_name, connection, stream);
 
-    static void on_node_info_process_onode_info(void *data, const struct pw_node_info *info) {
-        auto *process_data = (ArgStructs::process_onode_info_args *)data;
+        attach_vnode(record, vnode);
+        register_vnode_group(record, vnode);
 
-        const char *app_process_binary = spa_dict_lookup(info->props, PW_KEY_APP_PROCESS_BINARY);
-        const char *media_class = spa_dict_lookup(info->props, PW_KEY_MEDIA_CLASS);
-        const char *media_name = spa_dict_lookup(info->props, PW_KEY_MEDIA_NAME);
+        Logger::info({record.info.id, app_name.c_str(), "replicate"},
+                     "Creating replicated node ID %u for node ID %u (%s)", vnode_id, record.info.id,
+                     record.info.app_process_binary.c_str());
+    }
 
-        process_data->onode.app_process_binary = app_process_binary ? string(app_process_binary) : "";
-        process_data->onode.media_class = media_class ? string(media_class) : "";
-        process_data->onode.media_name = media_name ? string(media_name) : "";
+    static void set_vnode_scheduled(virtual_node_data &vnode, bool scheduled) {
+        if (vnode.scheduled == scheduled)
+            return;
 
-        process_data->info_flag = true;
-    }
+        vnode.scheduled = scheduled;
+        scheduled ? scheduled_vnodes++ : scheduled_vnodes--;
 
-    static void on_node_param_process_onode_info(void *data, int seq, uint32_t id, uint32_t index, uint32_t next,
-                                                 const struct spa_pod *param) {
-        auto *process_data = (ArgStructs::process_onode_info_args *)data;
+        Logger::info({.app = vnode.app_name.c_str(), .phase = "schedule"},
+                     "Graph load: %u of %u replicated nodes scheduled", scheduled_vnodes, vnode_count);
+    }
 
-        if (id != SPA_PARAM_Format)
+    static void on_stats_timer(void *data, uint64_t expirations) {
+        if (corrective_writes == 0)
             return;
 
-        auto *onode_info = &process_data->onode;
-        spa_format_audio_raw_parse(param, &onode_info->audio_info);
-        process_data->params_flag = true;
+        Logger::info({.phase = "stats"}, "%u corrective Props writes in the last minute", corrective_writes);
+        corrective_writes = 0;
     }
 
-    static void on_stream_state_changed_process_vnode_id(void *data, enum pw_stream_state old,
-                                                         enum pw_stream_state state, const char *error) {
+    static void start_stats_timer(struct pw_loop *loop) {
+        stats_loop = loop;
+        stats_timer = pw_loop_add_timer(loop, Stores::on_stats_timer, nullptr);
 
-        // process when its finished
-        if (state != PW_STREAM_STATE_PAUSED)
-            return;
+        struct timespec interval = {60, 0};
+        pw_loop_update_timer(loop, stats_timer, &interval, &interval, false);
+    }
 
-        ArgStructs::virtual_node_args::state_change_args::state_change_callback_args *state_data =
-            (ArgStructs::virtual_node_args::state_change_args::state_change_callback_args *)data;
+    static void count_corrective_write() {
+        corrective_writes++;
+        Metrics::count(Metrics::CORRECTIVE_WRITES);
+    }
 
-        if (state_data->stream_processed_flag)
-            return;
+    group_join join_vnode_group(onode_record &record) {
+        if (!Config::vnode_aggregate)
+            return group_join::CREATE;
 
-        state_data->vnode_id = pw_stream_get_node_id(state_data->stream);
+        string group_key = vnode_group_key(record.info);
+        auto it = this->vnode_groups.find(group_key);
 
-        Stores::set_vnode(state_data->onode_id, state_data->vnode_id, state_data->context, state_data->core,
-                          state_data->stream);
+        if (it == this->vnode_groups.end()) {
+            this->vnode_groups.emplace(group_key, nullptr);
+            return group_join::CREATE;
+        }
 
-        state_data->stream_processed_flag = true;
+        if (!it->second) {
+            this->group_waiters[group_key].push_back(record.info.id);
+            return group_join::WAITING;
+        }
 
-        spa_hook_remove(state_data->self_listener);
-        delete state_data->self_listener;
-        state_data->self_listener = nullptr;
+        attach_vnode(record, it->second);
+        Logger::info({record.info.id, it->second->app_name.c_str(), "replicate"},
+                     "Adding node ID %u to replicated node ID %u (%s)", record.info.id, it->second->id,
+                     it->second->app_name.c_str());
+        return group_join::JOINED;
     }
 
-    static void on_vnode_param_props(void *data, uint32_t id, const struct spa_pod *param) {
+    vector<onode_record *> join_group_waiters(onode_record &record) {
+        vector<onode_record *> joined = {};
+        virtual_node_data *vnode = record.vnode;
 
-        if (id != SPA_PARAM_Props)
-            return;
+        if (vnode->group_key.empty())
+            return joined;
 
-        auto *sync_data = (Stores::sync_params_data *)data;
+        auto it = this->group_waiters.find(vnode->group_key);
+        if (it == this->group_waiters.end())
+            return joined;
 
-        if (sync_data->param_data) {
-            free(sync_data->param_data);
-            sync_data->param_data = nullptr;
+        for (uint32_t waiter_id : it->second) {
+            onode_record *waiter = this->onode_records.find(waiter_id);
+
+            // removed while waiting, or a new onode that reused the id
+            if (!waiter || waiter->state != onode_state::FORMAT_READY || waiter->vnode)
+                continue;
+
+            attach_vnode(*waiter, vnode);
+            joined.push_back(waiter);
         }
-        sync_data->param_data = spa_pod_copy(param);
 
-        sync_data->ignore_next_onode_event = true;
-        pw_node_set_param(sync_data->onode, SPA_PARAM_Props, 0, sync_data->param_data);
+        this->group_waiters.erase(it);
+        return joined;
     }
 
-    static void on_onode_param_props(void *data, int seq, uint32_t id, uint32_t index, uint32_t next,
-                                     const struct spa_pod *param) {
+    bool unpark_vnode(onode_record &record) {
+        auto it = this->parked_vnodes.find(vnode_pool_key(record.info));
 
-        if (id != SPA_PARAM_Props)
-            return;
+        if (it == this->parked_vnodes.end())
+            return false;
 
-        auto *sync_data = (Stores::sync_params_data *)data;
+        parked_vnode *parked = it->second;
+        this->parked_vnodes.erase(it);
 
-        if (sync_data->ignore_next_onode_event) {
-            sync_data->ignore_next_onode_event = false;
-            return;
+        if (parked->vnode->connection->broken) {
+            delete parked;
+            return false;
         }
 
-        sync_data->ignore_next_onode_event = true;
-        pw_node_set_param(sync_data->onode, SPA_PARAM_Props, 0, sync_data->param_data);
+        attach_vnode(record, parked->vnode);
+        register_vnode_group(record, parked->vnode);
+        parked->vnode = nullptr;
+
+        Logger::info({record.info.id, record.vnode->app_name.c_str(), "replicate"},
+                     "Reusing replicated node ID %u for node ID %u (%s)", record.vnode->id, record.info.id,
+                     record.info.app_process_binary.c_str());
+
+        delete parked;
+        return true;
     }
-};
 
-class StaticPostHooks {
-  public:
-    static void create_virtual_node(struct ArgStructs::virtual_node_args &args) {
+    onode_record *find_onode(uint32_t onode_id) {
+        return this->onode_records.find(onode_id);
+    }
 
-        struct pw_properties *context_props =
-            pw_properties_new(PW_KEY_APP_NAME, args.onode.app_process_binary.c_str(), nullptr);
-        struct pw_context *virtual_context = pw_context_new(&args.loop, context_props, 0);
-        struct pw_core *virtual_core = pw_context_connect(virtual_context, nullptr, 0);
+    onode_record &create_onode(uint32_t onode_id) {
+        onode_record *record = this->record_pool.create(onode_id);
+        this->onode_records.insert(onode_id, record);
+        record->owner = this;
 
-        struct pw_properties *stream_props = pw_properties_new(
-            PW_KEY_MEDIA_TYPE, "Audio", PW_KEY_APP_NAME, args.onode.app_process_binary.c_str(), PW_KEY_MEDIA_CLASS,
-            args.onode.media_class.c_str(), PW_KEY_APP_ICON_NAME, args.onode.app_process_binary.c_str(),
-            PW_KEY_APP_PROCESS_BINARY, args.onode.app_process_binary.c_str(), nullptr);
-        struct pw_stream *virtual_stream =
-            pw_stream_new(virtual_core, ("Replicated " + args.onode.media_name).c_str(), stream_props);
+        Logger::info({onode_id, nullptr, "setup"}, "New pipewire node ID %u detected", onode_id);
+        return *record;
+    }
 
-        uint8_t buffer[1024];
-        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-        const struct spa_pod *params[1];
-        params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &args.onode.audio_info);
+    string remote_label() {
+        return this->name.empty() ? "" : " on " + this->name;
+    }
 
-        static const struct pw_stream_events stream_events = {
-            .version = PW_VERSION_STREAM_EVENTS,
-            .state_changed = args.state_change_callback,
-        };
+    vector<uint32_t> get_onode_ids() {
+        return this->onode_records.ids();
+    }
 
-        args.state_change_args->callback_args->initialise(*virtual_context, *virtual_core, *virtual_stream);
+    uint32_t record_count() {
+        return this->record_pool.size();
+    }
 
-        pw_stream_add_listener(virtual_stream, args.state_change_args->callback_args->self_listener, &stream_events,
-                               (void *)&args);
+    uint32_t indexed_count() {
+        return this->onode_records.size();
+    }
 
-        pw_stream_connect(virtual_stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
-                          (enum pw_stream_flags)(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS), params, 1);
+    uint32_t parked_count() {
+        return this->parked_vnodes.size();
     }
 
-    static void
-    post_virtual_stream_process(const ArgStructs::virtual_node_args::state_change_args::state_change_hook_args &args) {
+    static uint32_t live_vnodes() {
+        return vnode_count;
+    }
 
-        Stores::sync_params_data &data_sync = Stores::modify_sync_data_entry(args.onode_id);
+    bool has_live_vnode(const onode_record &record) {
+        return record.vnode && !record.vnode->connection->broken;
+    }
 
-        data_sync.vnode_reg = pw_core_get_registry(Stores::get_vnode(args.onode_id).core, PW_VERSION_REGISTRY, 0);
+    void track_startup_batch(const vector<uint32_t> &onode_ids) {
+        this->startup_pending.insert(onode_ids.begin(), onode_ids.end());
+    }
 
-        data_sync.vnode = (struct pw_node *)pw_registry_bind(data_sync.vnode_reg, args.vnode_id, PW_TYPE_INTERFACE_Node,
-                                                             PW_VERSION_NODE, 0);
+    void settle_startup_onode(uint32_t onode_id, bool replicated) {
+        if (!this->startup_pending.erase(onode_id))
+            return;
 
-        struct spa_hook *vnode_listener = new spa_hook();
-        struct spa_hook *onode_listener = new spa_hook();
+        this->startup_replicated += replicated ? 1 : 0;
+        if (!this->startup_pending.empty())
+            return;
 
-        data_sync.listeners.push_back(vnode_listener);
-        data_sync.listeners.push_back(onode_listener);
+        Logger::info({.phase = "startup"}, "Startup%s: %u existing node(s) replicated in %llu ms",
+                     remote_label().c_str(), this->startup_replicated,
+                     (unsigned long long)((monotonic_ns() - this->startup_begin_ns) / 1000000));
+    }
 
-        uint32_t param_ids_sub[] = {SPA_PARAM_Props};
+    // the record waits for a vnode again, returns the onodes that were waiting on a group vnode it was creating
+    vector<uint32_t> abandon_vnode_stream(onode_record &record) {
+        vector<uint32_t> abandoned = this->abandon_vnode_group(record);
 
-        pw_node_subscribe_params(Stores::modify_sync_data_entry(args.onode_id).vnode, param_ids_sub,
-                                 sizeof(param_ids_sub) / sizeof(param_ids_sub[0]));
-        pw_node_subscribe_params(Stores::modify_sync_data_entry(args.onode_id).onode, param_ids_sub,
-                                 sizeof(param_ids_sub) / sizeof(param_ids_sub[0]));
+        this->drop_pending_stream(record);
+        record.state = onode_state::FORMAT_READY;
+        return abandoned;
+    }
 
-        struct pw_stream *vstream = Stores::get_vnode(args.onode_id).stream;
+    void retire_vnode(onode_record &record) {
+        Stores::unhook(record.sync.listener);
+        record.sync.pending_writes.clear();
+        this->detach_vnode(record);
+    }
 
-        static const struct pw_stream_events vnode_events = {
-            .version = PW_VERSION_STREAM_EVENTS,
-            .param_changed = EventListeners::on_vnode_param_props,
-        };
+    void drop_parked_vnodes() {
+        for (const auto &[key, value] : this->parked_vnodes)
+            delete value;
+        this->parked_vnodes.clear();
+    }
 
-        static const struct pw_node_events onode_events = {
-            .version = PW_VERSION_NODE_EVENTS,
-            .param = EventListeners::on_onode_param_props,
-        };
+    vector<uint32_t> remove_onode(onode_record &record) {
+        uint32_t onode_id = record.info.id;
+        vector<uint32_t> abandoned = {};
+        PIPETRON_PROBE(onode_removing, this->id, onode_id, monotonic_ns());
+
+        Logger::info({onode_id, record.info.app_name.c_str(), "teardown"},
+                     "Cleaning up node ID %u (%s), %u onode and %u replicated stream event(s) received", onode_id,
+                     record.info.app_process_binary.c_str(), record.events, record.vnode ? record.vnode->events : 0);
+
+        if (record.state == onode_state::STREAM_CONNECTING)
+            abandoned = abandon_vnode_group(record);
 
-        pw_stream_add_listener(vstream, vnode_listener, &vnode_events,
-                               (void *)&Stores::modify_sync_data_entry(args.onode_id));
-        pw_proxy_add_object_listener((struct pw_proxy *)Stores::modify_sync_data_entry(args.onode_id).onode,
-                                     onode_listener, &onode_events,
-                                     (void *)&Stores::modify_sync_data_entry(args.onode_id));
+        this->detach_vnode(record);
+        this->release_onode(record);
+        this->settle_startup_onode(onode_id, false);
 
-        pw_node_enum_params(Stores::modify_sync_data_entry(args.onode_id).vnode, 0, SPA_PARAM_Props, 0, UINT32_MAX,
-                            nullptr);
-        pw_stream_update_params(vstream, nullptr, 0);
+        PIPETRON_PROBE(onode_removed, this->id, onode_id, monotonic_ns());
+        return abandoned;
     }
-};
 
-} // namespace
+    static void stop_stats_timer() {
+        if (!stats_timer)
+            return;
 
-class NodesManager {
+        pw_loop_destroy_source(stats_loop, stats_timer);
+        stats_timer = nullptr;
+    }
 
-  private:
-    struct process_and_vnode_args_data {
-        ArgStructs::process_onode_info_args *process_args;
-        ArgStructs::virtual_node_args *vnode_args;
-
-        ~process_and_vnode_args_data() {
-            if (this->process_args) {
-                delete this->process_args;
-                this->process_args = nullptr;
-            }
+    Stores(uint32_t id, const string &name) : id(id), name(name) {
+        this->startup_burst = true;
+        this->startup_registry = nullptr;
+        this->rebound_onodes = 0;
+        this->startup_replicated = 0;
+        this->startup_begin_ns = monotonic_ns();
+    }
 
-            if (this->vnode_args) {
-                delete this->vnode_args;
-                this->vnode_args = nullptr;
-            }
+    Stores(const Stores &) = delete;
+    Stores &operator=(const Stores &) = delete;
+
+    ~Stores() {
+        this->drop_parked_vnodes();
+
+        // members share their vnode, so it is deleted once after all of its members are gone
+        unordered_set<virtual_node_data *> vnodes = {};
+        for (uint32_t onode_id : this->onode_records.ids()) {
+            onode_record *record = this->onode_records.find(onode_id);
+
+            if (record->vnode)
+                vnodes.insert(record->vnode);
+
+            release_onode(*record);
         }
-    };
 
-    static void maybe_run_post_process(process_and_vnode_args_data *args) {
+        for (virtual_node_data *vnode : vnodes)
+            delete vnode;
 
-        if (!(args->process_args->info_flag && args->process_args->params_flag))
-            return;
+        this->vnode_groups.clear();
+        this->group_waiters.clear();
+    }
+};
 
-        spa_hook_remove(args->process_args->self_listener);
-        delete args->process_args->self_listener;
-        args->process_args->self_listener = nullptr;
+class EventListeners {
+  public:
+    // for syncing params between vnode and onode
 
-        ArgStructs::virtual_node_args *vnode_args = args->vnode_args;
-        args->vnode_args = nullptr;
+    static void on_node_info_process_onode_info(Stores::onode_record &record, const struct pw_node_info *info) {
+        Stores::onode_info &onode = record.info;
 
-        StaticPostHooks::create_virtual_node(*vnode_args);
+        const char *app_process_id = spa_dict_lookup(info->props, PW_KEY_APP_PROCESS_ID);
+        const char *app_process_binary = spa_dict_lookup(info->props, PW_KEY_APP_PROCESS_BINARY);
+        const char *media_class = spa_dict_lookup(info->props, PW_KEY_MEDIA_CLASS);
+        const char *media_name = spa_dict_lookup(info->props, PW_KEY_MEDIA_NAME);
 
-        delete args;
-        args = nullptr;
+        onode.app_process_id = app_process_id ? strtoul(app_process_id, nullptr, 10) : 0;
+        onode.app_process_binary = app_process_binary ? string(app_process_binary) : "";
+        onode.app_name = onode.app_process_binary;
+        onode.app_icon = onode.app_process_binary;
+        onode.media_class = media_class ? string(media_class) : "";
+        onode.media_name = media_name ? string(media_name) : "";
     }
 
-    static void on_node_info_process_hook(void *data, const struct pw_node_info *info) {
-        process_and_vnode_args_data *args = (process_and_vnode_args_data *)data;
+    static bool on_node_param_process_onode_info(Stores::onode_record &record, uint32_t id,
+                                                 const struct spa_pod *param) {
+        if (id != SPA_PARAM_Format || !param)
+            return false;
 
-        if (args->process_args->info_flag)
-            return;
+        spa_format_audio_raw_parse(param, &record.info.audio_info);
+        return true;
+    }
+
+    static bool same_audio_format(const spa_audio_info_raw &a, const spa_audio_info_raw &b) {
+        if (a.format != b.format || a.rate != b.rate || a.channels != b.channels || a.flags != b.flags)
+            return false;
+
+        for (uint32_t i = 0; i < a.channels && i < SPA_AUDIO_MAX_CHANNELS; i++) {
+            if (a.position[i] != b.position[i])
+                return false;
+        }
 
-        EventListeners::on_node_info_process_onode_info((void *)args->process_args, info);
-        NodesManager::maybe_run_post_process(args);
+        return true;
     }
 
-    static void on_node_param_process_hook(void *data, int seq, uint32_t id, uint32_t index, uint32_t next,
-                                           const struct spa_pod *param) {
+    static void on_vnode_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state,
+                                       const char *error) {
+        auto *vnode = (Stores::virtual_node_data *)data;
+        vnode->events++;
+        Metrics::count(Metrics::NODE_EVENTS);
+        Stores::set_vnode_scheduled(*vnode, state == PW_STREAM_STATE_STREAMING);
+    }
 
-        process_and_vnode_args_data *args = (process_and_vnode_args_data *)data;
+    static void push_props_delta(Stores::sync_params_data &sync_data) {
+        uint32_t delta = sync_data.vnode_props.diff(sync_data.onode_props) & props_state::SYNCED_FIELDS;
 
-        if (args->process_args->params_flag)
+        // no proxy while the daemon connection is being re-established
+        if (!delta || !sync_data.onode)
             return;
 
-        EventListeners::on_node_param_process_onode_info((void *)args->process_args, seq, id, index, next, param);
-        NodesManager::maybe_run_post_process(args);
+        uint8_t buffer[4096];
+        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        struct spa_pod *param = sync_data.vnode_props.build(builder, delta);
+
+        Stores::sync_params_data::pending_write write = {monotonic_ns(), delta, sync_data.vnode_props};
+        sync_data.pending_writes.push_back(write);
+
+        if (sync_data.vnode_change_ns) {
+            Metrics::observe(Metrics::PROPS_LATENCY, write.time_ns - sync_data.vnode_change_ns);
+            sync_data.vnode_change_ns = 0;
+        }
+
+        sync_data.onode_props.merge(sync_data.vnode_props, delta);
+        Backend::get().set_param(sync_data.onode, SPA_PARAM_Props, param);
+        Metrics::count(Metrics::PROPS_WRITES);
     }
 
-    static void on_state_change_callback_hook(void *data, enum pw_stream_state old, enum pw_stream_state state,
-                                              const char *error) {
-        struct ArgStructs::virtual_node_args *args = (struct ArgStructs::virtual_node_args *)data;
+    static void expire_pending_writes(Stores::sync_params_data &sync_data, uint64_t now_ns) {
+        while (!sync_data.pending_writes.empty() &&
+               now_ns - sync_data.pending_writes.front().time_ns > Stores::sync_params_data::PENDING_WRITE_TIMEOUT_NS)
+            sync_data.pending_writes.pop_front();
+    }
 
-        EventListeners::on_stream_state_changed_process_vnode_id((void *)args->state_change_args->callback_args, old,
-                                                                 state, error);
+    // an onode event carrying the values of an outstanding write confirms it and every write before it
+    static bool confirm_pending_write(Stores::sync_params_data &sync_data, const props_state &reported) {
+        uint64_t now_ns = monotonic_ns();
+        EventListeners::expire_pending_writes(sync_data, now_ns);
 
-        if (!args->state_change_args->callback_args->stream_processed_flag)
-            return;
+        for (auto it = sync_data.pending_writes.rbegin(); it != sync_data.pending_writes.rend(); it++) {
+            if (it->props.diff(reported) & it->fields)
+                continue;
 
-        StaticPostHooks::post_virtual_stream_process(*args->state_change_args->hook_args);
+            Metrics::observe(Metrics::ECHO_LATENCY, now_ns - it->time_ns);
+            sync_data.pending_writes.erase(sync_data.pending_writes.begin(), it.base());
+            return true;
+        }
 
-        delete args;
-        args = nullptr;
+        return false;
     }
 
-  public:
-    static void process_new_node(pw_registry *reg, pw_loop *loop, uint32_t id, const char *type) {
+    static void on_props_flush_timer(void *data, uint64_t expirations) {
+        auto *sync_data = (Stores::sync_params_data *)data;
 
-        Stores::modify_sync_data_entry(id).onode =
-            (struct pw_node *)pw_registry_bind(reg, id, type, PW_VERSION_NODE, 0);
+        sync_data->flush_pending = false;
+        sync_data->last_flush_ns = monotonic_ns();
+        EventListeners::push_props_delta(*sync_data);
+    }
 
-        static const struct pw_node_events node_events = {
-            .version = PW_VERSION_NODE_EVENTS,
-            .info = NodesManager::on_node_info_process_hook,
-            .param = NodesManager::on_node_param_process_hook,
-        };
+    // the first change after a quiet period goes out right away, later ones once per interval
+    static void schedule_props_flush(Stores::sync_params_data &sync_data) {
+        if (Config::props_max_rate_hz == 0 || !sync_data.loop) {
+            EventListeners::push_props_delta(sync_data);
+            return;
+        }
 
-        ArgStructs::process_onode_info_args *process_args =
-            new ArgStructs::process_onode_info_args(Stores::modify_onode_info_entry(id), new spa_hook());
+        if (sync_data.flush_pending)
+            return;
 
-        ArgStructs::virtual_node_args *vnode_args = new ArgStructs::virtual_node_args(
-            *loop, Stores::modify_onode_info_entry(id), NodesManager::on_state_change_callback_hook);
+        uint64_t interval_ns = 1000000000ull / Config::props_max_rate_hz;
+        uint64_t now_ns = monotonic_ns();
 
-        uint32_t param_ids_sub[] = {SPA_PARAM_Format};
-        pw_node_subscribe_params(Stores::modify_sync_data_entry(id).onode, param_ids_sub,
-                                 sizeof(param_ids_sub) / sizeof(param_ids_sub[0]));
+        if (now_ns - sync_data.last_flush_ns >= interval_ns) {
+            sync_data.last_flush_ns = now_ns;
+            EventListeners::push_props_delta(sync_data);
+            return;
+        }
 
-        process_and_vnode_args_data *args = new process_and_vnode_args_data();
-        args->vnode_args = vnode_args;
-        args->process_args = process_args;
-        pw_proxy_add_object_listener((struct pw_proxy *)Stores::modify_sync_data_entry(id).onode,
-                                     process_args->self_listener, &node_events, args);
+        if (!sync_data.flush_timer)
+            sync_data.flush_timer = pw_loop_add_timer(sync_data.loop, EventListeners::on_props_flush_timer, &sync_data);
 
-        pw_node_enum_params(Stores::modify_sync_data_entry(id).onode, 0, SPA_PARAM_Format, 0, UINT32_MAX, nullptr);
+        uint64_t remaining_ns = sync_data.last_flush_ns + interval_ns - now_ns;
+        struct timespec timeout = {(time_t)(remaining_ns / 1000000000ull), (long)(remaining_ns % 1000000000ull)};
+        pw_loop_update_timer(sync_data.loop, sync_data.flush_timer, &timeout, nullptr, false);
+        sync_data.flush_pending = true;
     }
 
-    static void on_global_remove(void *data, uint32_t id) {
-        Stores::cleanup_entries_with_onode_id(id);
-    }
+    static void write_vnode_props(Stores::virtual_node_data &vnode, const props_state &props, uint32_t fields) {
+        uint8_t buffer[4096];
+        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        struct spa_pod *param = props.build(builder, fields);
+
+        vnode.writing = true;
+        Backend::get().set_stream_param(vnode.stream, SPA_PARAM_Props, param);
+        vnode.writing = false;
+    }
+
+    static void update_member_props(Stores::virtual_node_data &vnode, Stores::onode_record &member) {
+        member.sync.vnode_props = vnode.props.with_channels(member.info.audio_info.channels);
+    }
+
+    static void on_vnode_param_props(void *data, uint32_t id, const struct spa_pod *param) {
+        auto *vnode = (Stores::virtual_node_data *)data;
+        vnode->events++;
+        Metrics::count(Metrics::NODE_EVENTS);
+
+        if (id != SPA_PARAM_Props || !param)
+            return;
+
+        if (vnode->writing) {
+            Metrics::count(Metrics::ECHOES_IGNORED);
+            return;
+        }
+
+        props_state changed = props_state::parse(param);
+        vnode->props.merge(changed, changed.fields);
+        uint64_t now_ns = monotonic_ns();
+        PIPETRON_PROBE(vnode_props, vnode->id, changed.fields, now_ns);
+
+        for (Stores::onode_record *member : vnode->members) {
+            VolumeCache::store(member->owner->name, member->info.app_name, member->info.media_class, vnode->props);
+
+            if (!member->sync.vnode_change_ns)
+                member->sync.vnode_change_ns = now_ns;
+
+            LOG_DEBUG({member->info.id, vnode->app_name.c_str(), "sync"},
+                      "Props fields 0x%x changed on replicated node ID %u", changed.fields, vnode->id);
+            PIPETRON_PROBE(props_forwarded, member->owner->id, member->info.id, vnode->id, now_ns);
+
+            EventListeners::update_member_props(*vnode, *member);
+            EventListeners::schedule_props_flush(member->sync);
+        }
+    }
+
+    // changes are taken in arrival order, a vnode change still held back loses the fields the app changed
+    static void pull_onode_props(Stores::onode_record &record, uint32_t fields) {
+        Stores::sync_params_data &sync_data = record.sync;
+        Stores::virtual_node_data *vnode = record.vnode;
+        uint64_t now_ns = monotonic_ns();
+
+        if (!vnode)
+            return;
+
+        sync_data.vnode_change_ns = 0;
+        sync_data.vnode_props.merge(sync_data.onode_props, fields);
+
+        // the vnode keeps its own channel count in aggregate mode
+        props_state pulled = sync_data.onode_props.with_channels(vnode->props.n_channel_volumes);
+        uint32_t delta = pulled.diff(vnode->props) & fields;
+
+        if (!delta)
+            return;
+
+        vnode->props.merge(pulled, delta);
+        EventListeners::write_vnode_props(*vnode, pulled, delta);
+        Metrics::count(Metrics::APP_CHANGES);
+
+        VolumeCache::store(record.owner->name, record.info.app_name, record.info.media_class, vnode->props);
+
+        for (Stores::onode_record *member : vnode->members) {
+            if (member == &record)
+                continue;
+
+            if (!member->sync.vnode_change_ns)
+                member->sync.vnode_change_ns = now_ns;
+
+            EventListeners::update_member_props(*vnode, *member);
+            EventListeners::schedule_props_flush(member->sync);
+        }
+    }
+
+    static void on_onode_param_props(void *data, int seq, uint32_t id, uint32_t index, uint32_t next,
+                                     const struct spa_pod *param) {
+
+        if (id != SPA_PARAM_Props)
+            return;
+
+        auto *record = (Stores::onode_record *)data;
+        Stores::sync_params_data *sync_data = &record->sync;
+        record->events++;
+        Metrics::count(Metrics::NODE_EVENTS);
+
+        props_state reported = props_state::parse(param);
+        sync_data->onode_props.merge(reported, reported.fields);
+
+        bool echo = EventListeners::confirm_pending_write(*sync_data, reported);
+        PIPETRON_PROBE(onode_props, record->owner->id, record->info.id, reported.fields, echo, monotonic_ns());
+
+        if (echo) {
+            Metrics::count(Metrics::ECHOES_IGNORED);
+            return;
+        }
+
+        if (!sync_data->pending_writes.empty()) {
+            EventListeners::schedule_pending_recheck(*record);
+            return;
+        }
+
+        EventListeners::reconcile_onode_props(*record);
+    }
+
+    static void reconcile_onode_props(Stores::onode_record &record) {
+        Stores::sync_params_data &sync_data = record.sync;
+
+        if (Config::bidirectional_sync) {
+            uint32_t changed = sync_data.onode_props.diff(sync_data.vnode_props) & props_state::SYNCED_FIELDS;
+            if (changed)
+                EventListeners::pull_onode_props(record, changed);
+            return;
+        }
+
+        if (!(sync_data.vnode_props.diff(sync_data.onode_props) & props_state::SYNCED_FIELDS))
+            return;
+
+        Stores::count_corrective_write();
+        EventListeners::push_props_delta(sync_data);
+    }
+
+    static void schedule_pending_recheck(Stores::onode_record &record) {
+        Stores::sync_params_data &sync_data = record.sync;
+        if (!sync_data.loop || sync_data.pending_writes.empty())
+            return;
+
+        if (!sync_data.recheck_timer)
+            sync_data.recheck_timer = pw_loop_add_timer(sync_data.loop, EventListeners::on_pending_recheck, &record);
+
+        uint64_t expiry_ns = sync_data.pending_writes.front().time_ns;
+        expiry_ns += Stores::sync_params_data::PENDING_WRITE_TIMEOUT_NS;
+        uint64_t now_ns = monotonic_ns();
+        uint64_t remaining_ns = (expiry_ns > now_ns ? expiry_ns - now_ns : 0) + 1;
+        struct timespec timeout = {(time_t)(remaining_ns / 1000000000ull), (long)(remaining_ns % 1000000000ull)};
+        pw_loop_update_timer(sync_data.loop, sync_data.recheck_timer, &timeout, nullptr, false);
+    }
+
+    static void on_pending_recheck(void *data, uint64_t expirations) {
+        auto *record = (Stores::onode_record *)data;
+
+        EventListeners::expire_pending_writes(record->sync, monotonic_ns());
+        if (!record->sync.pending_writes.empty()) {
+            EventListeners::schedule_pending_recheck(*record);
+            return;
+        }
+
+        EventListeners::reconcile_onode_props(*record);
+    }
+};
+
+class StaticPostHooks {
+  public:
+    static bool create_virtual_node(Stores::onode_record &record,
+                                    void (*state_change_callback)(void *, enum pw_stream_state,
+                                                                  enum pw_stream_state, const char *)) {
+        const Stores::onode_info &onode = record.info;
+        record.state = Stores::onode_state::STREAM_CONNECTING;
+
+        record.pending_connection = record.owner->acquire_app_connection(*record.sync.loop, onode.app_name);
+        if (!record.pending_connection)
+            return false;
+
+        struct pw_core *virtual_core = record.pending_connection->core;
+
+        struct pw_properties *stream_props = pw_properties_new(
+            PW_KEY_MEDIA_TYPE, "Audio", PW_KEY_APP_NAME, onode.app_name.c_str(), PW_KEY_MEDIA_CLASS,
+            onode.media_class.c_str(), PW_KEY_APP_ICON_NAME, onode.app_icon.c_str(), PW_KEY_APP_PROCESS_BINARY,
+            onode.app_process_binary.c_str(), Stores::REPLICA_KEY, "true", nullptr);
+
+        // nothing is ever produced on the stream, so in control only mode it is kept out of the graph entirely
+        enum pw_stream_flags stream_flags =
+            (enum pw_stream_flags)(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS);
+        if (Config::vnode_control_only) {
+            stream_flags = PW_STREAM_FLAG_INACTIVE;
+            pw_properties_set(stream_props, PW_KEY_NODE_PASSIVE, "true");
+        }
+
+        record.pending_stream =
+            Backend::get().new_stream(virtual_core, ("Replicated " + onode.media_name).c_str(), stream_props);
+
+        uint8_t buffer[1024];
+        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        const struct spa_pod *params[1];
+        params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &onode.audio_info);
+
+        static const struct pw_stream_events stream_events = {
+            .version = PW_VERSION_STREAM_EVENTS,
+            .state_changed = state_change_callback,
+        };
+
+        Backend::get().add_stream_listener(record.pending_stream, &record.stream_listener, &stream_events, &record);
+        Backend::get().connect_stream(record.pending_stream, stream_flags, params, 1);
+        return true;
+    }
+
+    // offers only the given format on the stream, which makes it renegotiate without being reconnected
+    static void update_stream_format(pw_stream *stream, const spa_audio_info_raw &audio_info) {
+        uint8_t buffer[1024];
+        struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        const struct spa_pod *params[1];
+        params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &audio_info);
+
+        Backend::get().update_stream_params(stream, params, 1);
+    }
+
+    static void follow_onode_format(Stores::onode_record &record, const spa_audio_info_raw &previous) {
+        Stores::virtual_node_data &vnode = *record.vnode;
+
+        if (vnode.members.size() == 1) {
+            vnode.props = vnode.props.remap_channels(previous, record.info.audio_info);
+            StaticPostHooks::update_stream_format(vnode.stream, record.info.audio_info);
+
+            if (vnode.props.fields & props_state::CHANNEL_VOLUMES)
+                EventListeners::write_vnode_props(vnode, vnode.props, props_state::CHANNEL_VOLUMES);
+        }
+
+        record.sync.onode_props = record.sync.onode_props.remap_channels(previous, record.info.audio_info);
+        EventListeners::update_member_props(vnode, record);
+        EventListeners::push_props_delta(record.sync);
+    }
+
+    // done once per vnode, its Props come from the stream's own param_changed
+    static void setup_vnode_sync(Stores::virtual_node_data &vnode) {
+        if (vnode.listener.link.next)
+            return;
+
+        static const struct pw_stream_events vnode_events = {
+            .version = PW_VERSION_STREAM_EVENTS,
+            .state_changed = EventListeners::on_vnode_state_changed,
+            .param_changed = EventListeners::on_vnode_param_props,
+        };
+
+        Backend::get().add_stream_listener(vnode.stream, &vnode.listener, &vnode_events, (void *)&vnode);
+        Backend::get().update_stream_params(vnode.stream, nullptr, 0);
+    }
+
+    static void setup_onode_sync(Stores::onode_record &record) {
+        record.state = Stores::onode_state::SYNCING;
+        record.retired = false;
+
+        EventListeners::update_member_props(*record.vnode, record);
+        StaticPostHooks::attach_sync_proxy(record);
+
+        if (record.added_ns) {
+            Metrics::count(Metrics::NODES_REPLICATED);
+            Metrics::observe(Metrics::REPLICATION_LATENCY, monotonic_ns() - record.added_ns);
+            record.added_ns = 0;
+        }
+
+        record.owner->settle_startup_onode(record.info.id, true);
+        PIPETRON_PROBE(onode_synced, record.owner->id, record.info.id, record.vnode->id, monotonic_ns());
+    }
+
+    // a syncing onode is subscribed to its Props, anything waiting for the onode is pushed
+    static void attach_sync_proxy(Stores::onode_record &record) {
+        Stores::sync_params_data &data_sync = record.sync;
+
+        // binding needs the sync connection, so it is done on the thread and the rest follows from there
+        if (!data_sync.onode && SyncLoop::threaded()) {
+            Stores::onode_request request = {record.owner, &record, record.info.id};
+            SyncLoop::post(StaticPostHooks::on_sync_bind_request, &request, sizeof(request));
+            return;
+        }
+
+        static const struct pw_node_events onode_events = {
+            .version = PW_VERSION_NODE_EVENTS,
+            .param = EventListeners::on_onode_param_props,
+        };
+
+        if (data_sync.onode && record.state == Stores::onode_state::SYNCING) {
+            // Format stays in on a shared proxy so renegotiations keep reaching the onode listener
+            uint32_t param_ids_sub[] = {SPA_PARAM_Props, SPA_PARAM_Format};
+            Backend::get().subscribe_params(data_sync.onode, param_ids_sub, data_sync.onode == record.watch ? 2 : 1);
+
+            Stores::unhook(data_sync.listener);
+            Backend::get().add_node_listener(data_sync.onode, &data_sync.listener, &onode_events, (void *)&record);
+        }
+
+        EventListeners::push_props_delta(data_sync);
+    }
+
+    static int on_sync_bind_request(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size,
+                                    void *user_data) {
+        auto *request = (const Stores::onode_request *)data;
+        Stores::onode_record *record = request->stores->find_onode(request->onode_id);
+
+        // a record without a watch proxy lost its daemon connection, it is bound again from the new registry
+        if (record != request->record || record->state == Stores::onode_state::CLOSING || !record->watch)
+            return 0;
+
+        if (Stores::bind_sync_proxy(*record))
+            StaticPostHooks::attach_sync_proxy(*record);
+        return 0;
+    }
+
+    static void post_virtual_stream_process(Stores::onode_record &record) {
+        Stores::virtual_node_data &vnode = *record.vnode;
+        StaticPostHooks::setup_vnode_sync(vnode);
+
+        uint32_t restored = record.sync.vnode_props.fields & props_state::SYNCED_FIELDS;
+        if (record.retired && restored && !(vnode.props.fields & props_state::SYNCED_FIELDS)) {
+            vnode.props.merge(record.sync.vnode_props, restored);
+            EventListeners::write_vnode_props(vnode, vnode.props, restored);
+        }
+
+        StaticPostHooks::setup_onode_sync(record);
+
+        for (Stores::onode_record *waiter : record.owner->join_group_waiters(record))
+            StaticPostHooks::setup_onode_sync(*waiter);
+    }
+
+    static void rename_virtual_node(Stores::onode_record &record, const string &app_name, const string &app_icon) {
+        if (record.info.app_name == app_name && record.info.app_icon == app_icon)
+            return;
+
+        record.info.app_name = app_name;
+        record.info.app_icon = app_icon;
+
+        if (!record.vnode)
+            return;
+
+        struct spa_dict_item items[] = {{PW_KEY_APP_NAME, app_name.c_str()}, {PW_KEY_APP_ICON_NAME, app_icon.c_str()}};
+        struct spa_dict dict = SPA_DICT_INIT(items, 2);
+        Backend::get().update_stream_properties(record.vnode->stream, &dict);
+
+        Logger::info({record.info.id, app_name.c_str(), "config"}, "Renamed replicated node ID %u to %s",
+                     record.vnode->id, app_name.c_str());
+    }
+
+    static void rebind_virtual_node(Stores::onode_record &record) {
+        string media_name = "Replicated " + record.info.media_name;
+        struct spa_dict_item items[] = {{PW_KEY_MEDIA_NAME, media_name.c_str()}};
+        struct spa_dict dict = SPA_DICT_INIT(items, 1);
+        Backend::get().update_stream_properties(record.vnode->stream, &dict);
+
+        StaticPostHooks::setup_onode_sync(record);
+
+        for (Stores::onode_record *waiter : record.owner->join_group_waiters(record))
+            StaticPostHooks::setup_onode_sync(*waiter);
+    }
+};
+
+} // namespace
+
+class NodesManager {
+
+  private:
+    inline static vector<Stores *> remotes = {};
+
+    inline static struct pw_loop *lifecycle_loop = nullptr;
+
+    inline static uint64_t resolve_tags = 0;
+
+    static constexpr uint64_t FIRST_RETRY_MS = 100;
+    static constexpr uint64_t MAX_RETRY_MS = 3200;
+
+    // every bind goes out before any info or Format request
+    static void flush_startup_batch(Stores &stores) {
+        vector<Stores::onode_record *> records;
+        vector<uint32_t> onode_ids;
+
+        {
+            SyncLoop::guard guard;
+
+            for (const Stores::startup_global &global : stores.startup_batch) {
+                records.push_back(&NodesManager::add_onode(stores, global.id, global.serial, global.added_ns));
+                onode_ids.push_back(global.id);
+            }
+
+            if (!onode_ids.empty())
+                stores.track_startup_batch(onode_ids);
+        }
+
+        for (size_t i = 0; i < records.size(); i++)
+            NodesManager::bind_proxies(stores.startup_registry, *records[i], stores.startup_batch[i].type.c_str());
+
+        for (Stores::onode_record *record : records)
+            NodesManager::request_onode_params(*record);
+
+        if (!onode_ids.empty())
+            Logger::info({.phase = "startup"}, "Startup%s: replicating %zu existing node(s)",
+                         stores.remote_label().c_str(), onode_ids.size());
+
+        stores.startup_batch.clear();
+        stores.startup_burst = false;
+    }
+
+    // the resolver keeps running once started, the setting decides whether it is asked
+    static bool resolving_app_names() {
+        return Config::resolve_app_names && AppResolver::running();
+    }
+
+    // every request gets a new tag, so a new onode that took over the id of one being resolved isn't named after it
+    static void resolve_app_name(Stores::onode_record &record) {
+        const Stores::onode_info &onode = record.info;
+        record.resolve_tag = ++resolve_tags;
+
+        AppResolver::resolve(record.owner, onode.id, record.resolve_tag, onode.app_process_id,
+                             onode.app_process_binary);
+    }
+
+    static void on_app_resolved(void *owner, uint32_t onode_id, uint64_t tag,
+                                const AppResolver::app_identity &identity) {
+        SyncLoop::guard guard;
+        Stores::onode_record *record = ((Stores *)owner)->find_onode(onode_id);
+
+        if (!record || record->resolve_tag != tag)
+            return;
+
+        record->resolve_tag = 0;
+
+        // resolve_app_names may have been turned off while the request was out, refresh_app_names skipped the record
+        const Stores::onode_info &onode = record->info;
+        bool resolved = Config::resolve_app_names;
+
+        if (record->state == Stores::onode_state::SYNCING) {
+            StaticPostHooks::rename_virtual_node(*record, resolved ? identity.name : onode.app_process_binary,
+                                                 resolved ? identity.icon : onode.app_process_binary);
+            return;
+        }
+
+        if (record->state != Stores::onode_state::FORMAT_READY)
+            return;
+
+        if (resolved) {
+            record->info.app_name = identity.name;
+            record->info.app_icon = identity.icon;
+        }
+
+        NodesManager::apply_cached_props(*record);
+        NodesManager::replicate_onode(*record);
+    }
+
+    static void on_format_ready(Stores::onode_record &record) {
+        record.state = Stores::onode_state::FORMAT_READY;
+        PIPETRON_PROBE(onode_ready, record.owner->id, record.info.id, monotonic_ns());
+
+        const Stores::onode_info &onode = record.info;
+        LOG_DEBUG({onode.id, onode.app_process_binary.c_str(), "setup"}, "Format %u Hz, %u channel(s), media class %s",
+                  onode.audio_info.rate, onode.audio_info.channels, onode.media_class.c_str());
+        if (NodesManager::resolving_app_names() && onode.app_process_id != 0) {
+            NodesManager::resolve_app_name(record);
+            return;
+        }
+
+        NodesManager::replicate_onode(record);
+    }
+
+    static void replicate_onode(Stores::onode_record &record) {
+        Stores::stop_retry_timer(record);
+
+        if (Config::lazy_replication && record.node_state != PW_NODE_STATE_RUNNING) {
+            LOG_DEBUG({record.info.id, record.info.app_name.c_str(), "lazy"},
+                      "Node ID %u not running, replication deferred", record.info.id);
+            record.deferred = true;
+            record.owner->settle_startup_onode(record.info.id, false);
+            return;
+        }
+
+        Stores::group_join join = record.owner->join_vnode_group(record);
+
+        if (join == Stores::group_join::JOINED) {
+            StaticPostHooks::setup_onode_sync(record);
+        } else if (join == Stores::group_join::CREATE && record.owner->unpark_vnode(record)) {
+            StaticPostHooks::rebind_virtual_node(record);
+        } else if (join == Stores::group_join::CREATE) {
+            record.state = Stores::onode_state::STREAM_CONNECTING;
+            Stores::onode_request request = {record.owner, &record, record.info.id};
+            SyncLoop::post(NodesManager::on_vnode_request, &request, sizeof(request));
+        }
+    }
+
+    // runs on the sync thread, so the app connect and the stream creation don't hold the lock for the main loop
+    static int on_vnode_request(struct spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size,
+                                void *user_data) {
+        auto *request = (const Stores::onode_request *)data;
+        Stores::onode_record *record = request->stores->find_onode(request->onode_id);
+
+        if (record != request->record || record->state != Stores::onode_state::STREAM_CONNECTING ||
+            record->pending_connection || record->retry_timer)
+            return 0;
+
+        if (!StaticPostHooks::create_virtual_node(*record, NodesManager::on_stream_state_changed))
+            NodesManager::fail_onode(*record, "couldn't connect to PipeWire");
+        return 0;
+    }
+
+    static void on_node_state_changed(Stores::onode_record &record, enum pw_node_state previous) {
+        if (record.node_state == PW_NODE_STATE_RUNNING) {
+            if (record.idle_timer)
+                pw_loop_update_timer(record.idle_loop, record.idle_timer, nullptr, nullptr, false);
+
+            if (record.deferred && record.state == Stores::onode_state::FORMAT_READY) {
+                record.deferred = false;
+                NodesManager::replicate_onode(record);
+            }
+            return;
+        }
+
+        if (previous != PW_NODE_STATE_RUNNING || record.state != Stores::onode_state::SYNCING ||
+            Config::idle_retire_ms == 0)
+            return;
+
+        if (!record.idle_timer) {
+            record.idle_loop = lifecycle_loop;
+            record.idle_timer = pw_loop_add_timer(lifecycle_loop, NodesManager::on_idle_timer, &record);
+        }
+
+        struct timespec timeout = {(time_t)(Config::idle_retire_ms / 1000),
+                                   (long)(Config::idle_retire_ms % 1000) * 1000000};
+        pw_loop_update_timer(record.idle_loop, record.idle_timer, &timeout, nullptr, false);
+    }
+
+    static void arm_retry_timer(Stores::onode_record &record, uint64_t delay_ms) {
+        // a zero timeout disarms the timer, so "now" is one nanosecond
+        struct timespec timeout = {(time_t)(delay_ms / 1000), delay_ms ? (long)(delay_ms % 1000) * 1000000 : 1};
+
+        if (!record.retry_timer)
+            record.retry_timer = pw_loop_add_timer(record.sync.loop, NodesManager::on_retry_timer, &record);
+        pw_loop_update_timer(record.sync.loop, record.retry_timer, &timeout, nullptr, false);
+    }
+
+    // the onode is still in the registry, so its record stays and replication is retried with backoff. only the first
+    // failure in a row is logged as an error
+    static void fail_onode(Stores::onode_record &record, const char *error) {
+        if (record.retry_timer)
+            return;
+
+        if (record.failures == 0)
+            Logger::error({record.info.id, record.info.app_name.c_str(), "replicate"},
+                          "Replicated stream for node ID %u failed: %s", record.info.id,
+                          error ? error : "unknown error");
+        else
+            LOG_DEBUG({record.info.id, record.info.app_name.c_str(), "replicate"},
+                      "Replicated stream for node ID %u failed again: %s", record.info.id,
+                      error ? error : "unknown error");
+
+        record.failures++;
+        NodesManager::arm_retry_timer(record, 0);
+    }
+
+    // fires right after the failure, outside the stream's own event, to drop the stream, and once more after the
+    // backoff to replicate again
+    static void on_retry_timer(void *data, uint64_t expirations) {
+        SyncLoop::guard guard;
+        auto *record = (Stores::onode_record *)data;
+
+        if (record->state == Stores::onode_state::STREAM_CONNECTING) {
+            Stores &stores = *record->owner;
+            NodesManager::hand_over_group(stores, stores.abandon_vnode_stream(*record));
+
+            uint64_t delay_ms = std::min(FIRST_RETRY_MS << std::min(record->failures - 1, 5u), MAX_RETRY_MS);
+            Logger::info({record->info.id, record->info.app_name.c_str(), "replicate"},
+                         "Retrying node ID %u in %llu ms, attempt %u", record->info.id, (unsigned long long)delay_ms,
+                         record->failures + 1);
+            NodesManager::arm_retry_timer(*record, delay_ms);
+            return;
+        }
+
+        Stores::stop_retry_timer(*record);
+        if (record->state == Stores::onode_state::FORMAT_READY && !record->vnode)
+            NodesManager::replicate_onode(*record);
+    }
+
+    // the record stays, a recreated vnode starts from the Props last synced through it
+    static void on_idle_timer(void *data, uint64_t expirations) {
+        SyncLoop::guard guard;
+        auto *record = (Stores::onode_record *)data;
+
+        if (record->state != Stores::onode_state::SYNCING || record->node_state == PW_NODE_STATE_RUNNING)
+            return;
+
+        Logger::info({record->info.id, record->info.app_name.c_str(), "lazy"},
+                     "Node ID %u idle for %u ms, retiring its replicated node", record->info.id,
+                     Config::idle_retire_ms);
+
+        record->owner->retire_vnode(*record);
+        record->state = Stores::onode_state::FORMAT_READY;
+        record->deferred = true;
+        record->retired = true;
+    }
+
+    static void close_onode(Stores::onode_record &record, bool hand_over_group) {
+        Stores &stores = *record.owner;
+        vector<uint32_t> abandoned = stores.remove_onode(record);
+
+        if (hand_over_group)
+            NodesManager::hand_over_group(stores, abandoned);
+    }
+
+    // the onodes that waited on a group vnode that won't come, one of them creates it instead
+    static void hand_over_group(Stores &stores, const vector<uint32_t> &abandoned) {
+        for (uint32_t waiter_id : abandoned) {
+            Stores::onode_record *waiter = stores.find_onode(waiter_id);
+
+            if (waiter && waiter->state == Stores::onode_state::FORMAT_READY && !waiter->vnode)
+                NodesManager::replicate_onode(*waiter);
+        }
+    }
+
+    static void on_node_info_process_hook(void *data, const struct pw_node_info *info) {
+        SyncLoop::guard guard;
+        auto *record = (Stores::onode_record *)data;
+        record->events++;
+        Metrics::count(Metrics::NODE_EVENTS);
+
+        enum pw_node_state previous = record->node_state;
+        if (info->change_mask & PW_NODE_CHANGE_MASK_STATE)
+            record->node_state = info->state;
+
+        if (record->state != Stores::onode_state::BINDING) {
+            if (record->node_state != previous && record->state != Stores::onode_state::CLOSING)
+                NodesManager::on_node_state_changed(*record, previous);
+            return;
+        }
+
+        EventListeners::on_node_info_process_onode_info(*record, info);
+        record->state = Stores::onode_state::INFO_READY;
+        NodesManager::listen_onode(*record);
+
+        // a name AppResolver will replace isn't a cache key yet, the lookup waits for the resolved one
+        if (!NodesManager::resolving_app_names() || record->info.app_process_id == 0)
+            NodesManager::apply_cached_props(*record);
+
+        if (record->has_format)
+            NodesManager::on_format_ready(*record);
+    }
+
+    static void on_node_param_process_hook(void *data, int seq, uint32_t id, uint32_t index, uint32_t next,
+                                           const struct spa_pod *param) {
+        SyncLoop::guard guard;
+        auto *record = (Stores::onode_record *)data;
+
+        if (id != SPA_PARAM_Props) {
+            record->events++;
+            Metrics::count(Metrics::NODE_EVENTS);
+        }
+
+        if (record->state == Stores::onode_state::CLOSING || id != SPA_PARAM_Format || !param)
+            return;
+
+        if (record->state != Stores::onode_state::BINDING && record->state != Stores::onode_state::INFO_READY) {
+            NodesManager::on_format_changed(*record, param);
+            return;
+        }
+
+        if (!EventListeners::on_node_param_process_onode_info(*record, id, param))
+            return;
+
+        record->has_format = true;
+
+        if (record->state == Stores::onode_state::INFO_READY)
+            NodesManager::on_format_ready(*record);
+    }
+
+    // updated in place rather than recreated, so the vnode keeps its id and the session manager's settings
+    static void on_format_changed(Stores::onode_record &record, const struct spa_pod *param) {
+        spa_audio_info_raw previous = record.info.audio_info;
+        spa_audio_info_raw current = {};
+
+        if (spa_format_audio_raw_parse(param, &current) < 0 ||
+            EventListeners::same_audio_format(previous, current))
+            return;
+
+        record.info.audio_info = current;
+        Logger::info({record.info.id, record.info.app_name.c_str(), "format"},
+                     "Node ID %u renegotiated to %u Hz, %u channel(s)", record.info.id, current.rate, current.channels);
+
+        if (record.state == Stores::onode_state::FORMAT_READY)
+            return;
+
+        // no stream yet while the vnode request waits for the sync thread or after a failed connect, it is created
+        // from the stored format
+        if (record.state == Stores::onode_state::STREAM_CONNECTING) {
+            if (record.pending_stream)
+                StaticPostHooks::update_stream_format(record.pending_stream, current);
+            return;
+        }
+
+        StaticPostHooks::follow_onode_format(record, previous);
+    }
+
+    static void on_stream_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state,
+                                        const char *error) {
+        auto *record = (Stores::onode_record *)data;
+
+        // process when its finished, the teardown of a closing record fires this too
+        if (record->state != Stores::onode_state::STREAM_CONNECTING)
+            return;
+
+        if (state == PW_STREAM_STATE_ERROR) {
+            NodesManager::fail_onode(*record, error);
+            return;
+        }
+
+        if (state != PW_STREAM_STATE_PAUSED)
+            return;
+
+        Stores::unhook(record->stream_listener);
+        record->failures = 0;
+
+        pw_stream *stream = record->pending_stream;
+        Stores::app_connection *connection = record->pending_connection;
+        record->pending_stream = nullptr;
+        record->pending_connection = nullptr;
+
+        record->owner->set_vnode(*record, Backend::get().stream_node_id(stream), record->info.app_name, connection,
+                                 stream);
+        PIPETRON_PROBE(vnode_paused, record->owner->id, record->info.id, record->vnode->id, monotonic_ns());
+        StaticPostHooks::post_virtual_stream_process(*record);
+    }
+
+    // sets the onode to its app's last volume before its vnode exists, through the normal sync path
+    static void apply_cached_props(Stores::onode_record &record) {
+        const Stores::onode_info &onode = record.info;
+
+        if (onode.app_name.empty() || onode.media_class.empty())
+            return;
+
+        if (!VolumeCache::lookup(record.owner->name, onode.app_name, onode.media_class, record.sync.vnode_props))
+            return;
+
+        StaticPostHooks::attach_sync_proxy(record);
+    }
+
+    // a rebound record is reachable from the sync thread through its vnode, only the bind itself is left unguarded
+    static void bind_proxies(pw_registry *reg, Stores::onode_record &record, const char *type) {
+        struct pw_node *watch = Backend::get().bind_node(reg, record.info.id, type);
+
+        SyncLoop::guard guard;
+        record.watch = watch;
+        record.sync.loop = SyncLoop::get_loop();
+        record.sync.onode = SyncLoop::threaded() ? nullptr : watch;
+    }
+
+    static Stores::onode_record &add_onode(Stores &stores, uint32_t id, const string &serial, uint64_t added_ns) {
+        Stores::onode_record &record = stores.create_onode(id);
+
+        record.info.serial = serial;
+        record.added_ns = added_ns;
+
+        return record;
+    }
+
+    static void on_node_info_count_hook(void *data, const struct pw_node_info *info) {
+        SyncLoop::guard guard;
+        ((Stores::onode_record *)data)->events++;
+        Metrics::count(Metrics::NODE_EVENTS);
+    }
+
+    static void listen_onode(Stores::onode_record &record) {
+        static const struct pw_node_events node_events = {
+            .version = PW_VERSION_NODE_EVENTS,
+            .info = NodesManager::on_node_info_process_hook,
+            .param = NodesManager::on_node_param_process_hook,
+        };
+
+        static const struct pw_node_events format_events = {
+            .version = PW_VERSION_NODE_EVENTS,
+            .info = NodesManager::on_node_info_count_hook,
+            .param = NodesManager::on_node_param_process_hook,
+        };
+
+        Stores::unhook(record.onode_listener);
+        Backend::get().add_node_listener(record.watch, &record.onode_listener,
+                                         record.state == Stores::onode_state::BINDING || Config::lazy_replication
+                                             ? &node_events
+                                             : &format_events,
+                                         &record);
+    }
+
+    // subscribing sends the current Format, no separate enumeration is needed
+    static void request_onode_params(Stores::onode_record &record) {
+        uint32_t param_ids_sub[] = {SPA_PARAM_Format};
+        Backend::get().subscribe_params(record.watch, param_ids_sub, sizeof(param_ids_sub) / sizeof(param_ids_sub[0]));
+
+        NodesManager::listen_onode(record);
+    }
+
+    static void rebind_onode(pw_registry *reg, Stores::onode_record &record, const char *type) {
+        NodesManager::bind_proxies(reg, record, type);
+
+        SyncLoop::guard guard;
+        NodesManager::request_onode_params(record);
+        StaticPostHooks::setup_onode_sync(record);
+        record.owner->rebound_onodes++;
+    }
+
+  public:
+    struct stats {
+        uint32_t records;
+        uint32_t indexed;
+        uint32_t vnodes;
+        uint32_t parked;
+    };
+
+    // a vnode matched by a broad rule would be replicated again, and its replica after it
+    static bool is_replica(const struct spa_dict *props) {
+        return props && spa_dict_lookup(props, Stores::REPLICA_KEY);
+    }
+
+    static void process_new_node(uint32_t remote, pw_registry *reg, uint32_t id, const char *type,
+                                 const struct spa_dict *props) {
+        Stores &stores = *remotes[remote];
+        const char *serial = props ? spa_dict_lookup(props, PW_KEY_OBJECT_SERIAL) : nullptr;
+        Stores::onode_record *record;
+        bool rebind = false;
+
+        {
+            SyncLoop::guard guard;
+            record = stores.find_onode(id);
+
+            if (record && stores.remembered_onodes.erase(id))
+                rebind = serial && record->info.serial == serial && stores.has_live_vnode(*record);
+        }
+
+        if (rebind) {
+            NodesManager::rebind_onode(reg, *record, type);
+            return;
+        }
+
+        {
+            SyncLoop::guard guard;
+
+            // the sync thread may have closed it in between
+            record = stores.find_onode(id);
+            if (record)
+                NodesManager::close_onode(*record, true);
+
+            if (stores.startup_burst) {
+                stores.startup_registry = reg;
+                stores.startup_batch.push_back({id, type, serial ? serial : "", monotonic_ns()});
+                return;
+            }
+
+            record = &NodesManager::add_onode(stores, id, serial ? serial : "", monotonic_ns());
+        }
+
+        NodesManager::bind_proxies(reg, *record, type);
+        NodesManager::request_onode_params(*record);
+    }
+
+    static void on_global_remove(uint32_t remote, uint32_t id) {
+        SyncLoop::guard guard;
+        Stores &stores = *remotes[remote];
+
+        for (auto it = stores.startup_batch.begin(); it != stores.startup_batch.end(); it++) {
+            if (it->id == id) {
+                stores.startup_batch.erase(it);
+                return;
+            }
+        }
+
+        Stores::onode_record *record = stores.find_onode(id);
+        if (record)
+            NodesManager::close_onode(*record, true);
+    }
+
+    // replicated onodes keep their record and vnode until the new registry says whether they still exist
+    static void on_daemon_lost(uint32_t remote) {
+        SyncLoop::guard guard;
+        Stores &stores = *remotes[remote];
+
+        stores.startup_batch.clear();
+        stores.drop_parked_vnodes();
+
+        for (uint32_t onode_id : stores.get_onode_ids()) {
+            Stores::onode_record *record = stores.find_onode(onode_id);
+
+            if (record->state != Stores::onode_state::SYNCING) {
+                NodesManager::close_onode(*record, false);
+                continue;
+            }
+
+            Stores::drop_watch(*record);
+            record->sync.reset();
+            stores.remembered_onodes.insert(onode_id);
+        }
+
+        SyncLoop::disconnect();
+    }
+
+    static void on_registry_synced(uint32_t remote, bool reconnected) {
+        Stores &stores = *remotes[remote];
+
+        if (stores.startup_burst)
+            NodesManager::flush_startup_batch(stores);
+
+        if (!reconnected)
+            return;
+
+        SyncLoop::guard guard;
+        uint32_t dropped = stores.remembered_onodes.size();
+        for (uint32_t onode_id : stores.remembered_onodes) {
+            Stores::onode_record *record = stores.find_onode(onode_id);
+            if (record)
+                NodesManager::close_onode(*record, true);
+        }
+        stores.remembered_onodes.clear();
+
+        Logger::info({.phase = "reconnect"}, "Rehydrated after reconnect%s: %u replicated node(s) kept, %u dropped",
+                     stores.remote_label().c_str(), stores.rebound_onodes, dropped);
+        stores.rebound_onodes = 0;
+    }
+
+    static void init(struct pw_loop *loop, bool in_daemon) {
+        lifecycle_loop = loop;
+
+        if (!SyncLoop::start(loop, Config::sync_thread))
+            Logger::warning({.phase = "sync"}, "Couldn't start the sync thread, running on a single loop");
+
+        {
+            SyncLoop::guard guard;
+            Stores::start_stats_timer(SyncLoop::get_loop());
+        }
+
+        if (Config::resolve_app_names)
+            AppResolver::start(loop, NodesManager::on_app_resolved);
+
+        if (Config::volume_cache && !VolumeCache::open(VolumeCache::default_path()))
+            Logger::warning({.phase = "cache"}, "Volume cache unavailable, new streams start at their own volume");
+
+        Metrics::start(loop, Config::metrics_socket ? Metrics::default_socket_path() : "", !in_daemon);
+    }
+
+    static uint32_t add_remote(const string &name) {
+        remotes.push_back(new Stores(remotes.size(), name));
+        return remotes.size() - 1;
+    }
+
+    static void refresh_app_names() {
+        SyncLoop::guard guard;
+
+        if (Config::resolve_app_names && !AppResolver::running())
+            AppResolver::start(lifecycle_loop, NodesManager::on_app_resolved);
+
+        for (Stores *stores : remotes) {
+            for (uint32_t onode_id : stores->get_onode_ids()) {
+                Stores::onode_record *record = stores->find_onode(onode_id);
+                const Stores::onode_info &onode = record->info;
+
+                bool deferred = record->state == Stores::onode_state::FORMAT_READY && record->deferred;
+                if (record->resolve_tag || (record->state != Stores::onode_state::SYNCING && !deferred))
+                    continue;
+
+                if (Config::resolve_app_names && onode.app_process_id != 0) {
+                    NodesManager::resolve_app_name(*record);
+                    continue;
+                }
+
+                StaticPostHooks::rename_virtual_node(*record, onode.app_process_binary, onode.app_process_binary);
+            }
+        }
+    }
+
+    // summed over every remote
+    static stats get_stats() {
+        SyncLoop::guard guard;
+        stats current = {0, 0, Stores::live_vnodes(), 0};
+
+        for (Stores *stores : remotes) {
+            current.records += stores->record_count();
+            current.indexed += stores->indexed_count();
+            current.parked += stores->parked_count();
+        }
+
+        return current;
+    }
 
     static void cleanup() {
-        Stores::cleanup();
+        Metrics::stop();
+        AppResolver::stop();
+        SyncLoop::drain();
+
+        {
+            SyncLoop::guard guard;
+
+            for (Stores *stores : remotes)
+                delete stores;
+
+            remotes.clear();
+            Stores::stop_stats_timer();
+        }
+
+        SyncLoop::stop();
+        VolumeCache::close();
     }
 };
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "backend.hpp"
+#include "clock.hpp"
+#include "config.hpp"
+#include "config_watcher.hpp"
+#include "daemon_connection.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "node_rules.hpp"
+#include "nodes_manager.hpp"
+#include "probes.hpp"
+#include "pipewire/context.h"
+#include "pipewire/core.h"
+#include "pipewire/node.h"
+#include "pipewire/properties.h"
+#include "spa/utils/dict.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+/**
+everything between a pipewire context and running replication, shared by the standalone client and the daemon module.
+inside the daemon the context is the daemon's own, and the registry and app connections are in-process clients of it
+instead of socket connections.
+
+the standalone client can serve several remotes, one session each with its own daemon connection and node state. they
+all run on the context's loop and share its caches, app name resolution and metrics.
+
+a change to the config file is applied to the running nodes: node globals are kept with their props, so changed rules
+only add or remove the nodes whose match changed, and a switch of resolve_app_names renames vnodes in place
+*/
+class Pipetron {
+  private:
+    // a node global of the registry, and whether the rules matched it the last time they were checked
+    struct node_global {
+        struct pw_properties *props;
+        bool matched;
+    };
+
+    struct session {
+        uint32_t remote;
+        DaemonConnection connection;
+        unordered_map<uint32_t, node_global> nodes;
+
+        session(const string &name) : connection(name) {
+            this->remote = NodesManager::add_remote(name);
+        }
+
+        ~session() {
+            this->forget_nodes();
+        }
+
+        void forget_nodes() {
+            for (auto &[id, node] : this->nodes)
+                pw_properties_free(node.props);
+            this->nodes.clear();
+        }
+    };
+
+    inline static vector<session *> sessions = {};
+    inline static string config_path = "";
+    inline static bool in_daemon = false;
+
+    // what the environment rules out whatever the config says, applied after every load
+    static void apply_overrides(bool in_daemon, size_t remote_count) {
+        // a thread of its own would have to come back in through the daemon's socket
+        if (in_daemon && Config::sync_thread) {
+            Logger::warning({.phase = "sync"}, "sync_thread is ignored when running inside the daemon");
+            Config::sync_thread = false;
+        }
+
+        // the sync thread has a single connection of its own, to the default remote
+        if (remote_count > 1 && Config::sync_thread) {
+            Logger::warning({.phase = "sync"}, "sync_thread is ignored when serving more than one remote");
+            Config::sync_thread = false;
+        }
+    }
+
+    // changed rules are checked against every known node global, only nodes whose match flipped are touched
+    static void apply_rules(uint32_t &added, uint32_t &removed) {
+        NodeRules::compile(Config::rules.empty() ? NodeRules::default_rules() : Config::rules);
+
+        for (session *current : sessions) {
+            for (auto &[id, node] : current->nodes) {
+                bool matched = NodeRules::match(&node.props->dict) == node_rule::REPLICATE;
+                if (matched == node.matched)
+                    continue;
+
+                node.matched = matched;
+                if (matched) {
+                    Metrics::count(Metrics::NODES_MATCHED);
+                    NodesManager::process_new_node(current->remote, current->connection.get_registry(), id,
+                                                   PW_TYPE_INTERFACE_Node, &node.props->dict);
+                    added++;
+                } else {
+                    // the node stays in the registry, but is torn down as if it was removed
+                    NodesManager::on_global_remove(current->remote, id);
+                    removed++;
+                }
+            }
+        }
+    }
+
+    static void on_config_changed() {
+        Config::settings running = Config::capture();
+
+        {
+            SyncLoop::guard guard;
+            Config::reload(config_path);
+            Pipetron::apply_overrides(in_daemon, sessions.size());
+            Config::keep_startup_settings(running);
+        }
+
+        Config::log_live_changes(running);
+
+        Logger::set_level(Config::log_threshold);
+
+        uint32_t added = 0;
+        uint32_t removed = 0;
+        if (Config::rules != running.rules)
+            Pipetron::apply_rules(added, removed);
+
+        if (Config::resolve_app_names != running.resolve_app_names)
+            NodesManager::refresh_app_names();
+
+        Logger::info({.phase = "config"}, "Config reloaded, %u node(s) newly matched and %u no longer matched", added,
+                     removed);
+    }
+
+    static void on_registry_global(void *data, uint32_t id, uint32_t permissions, const char *type, uint32_t version,
+                                   const struct spa_dict *props) {
+
+        if (strcmp(type, PW_TYPE_INTERFACE_Node) != 0 || NodesManager::is_replica(props))
+            return;
+
+        Metrics::count(Metrics::NODES_SEEN);
+        auto *current = (session *)data;
+        bool matched = NodeRules::match(props) == node_rule::REPLICATE;
+
+        if (props) {
+            auto it = current->nodes.find(id);
+            if (it != current->nodes.end())
+                pw_properties_free(it->second.props);
+            current->nodes[id] = {pw_properties_new_dict(props), matched};
+        }
+
+        if (!matched)
+            return;
+
+        Metrics::count(Metrics::NODES_MATCHED);
+        PIPETRON_PROBE(node_matched, current->remote, id, monotonic_ns());
+        NodesManager::process_new_node(current->remote, current->connection.get_registry(), id, type, props);
+    }
+
+    static void on_registry_global_remove(void *data, uint32_t id) {
+        auto *current = (session *)data;
+        auto it = current->nodes.find(id);
+
+        if (it != current->nodes.end()) {
+            pw_properties_free(it->second.props);
+            current->nodes.erase(it);
+        }
+
+        NodesManager::on_global_remove(current->remote, id);
+    }
+
+    // the new registry announces every global again
+    static void on_daemon_lost(void *data) {
+        auto *current = (session *)data;
+        current->forget_nodes();
+        NodesManager::on_daemon_lost(current->remote);
+    }
+
+    static void on_registry_synced(void *data, bool reconnected) {
+        NodesManager::on_registry_synced(((session *)data)->remote, reconnected);
+    }
+
+  public:
+    // the Logger is started and stopped by the caller, it outlives everything here. an empty remote name is the
+    // default remote, inside the daemon only that one is served
+    static bool start(struct pw_context *context, const string &config_path, bool in_daemon,
+                      const vector<string> &remotes = {""}) {
+        Pipetron::config_path = config_path;
+        Pipetron::in_daemon = in_daemon;
+        Config::load(config_path);
+        Pipetron::apply_overrides(in_daemon, remotes.size());
+        Logger::set_level(Config::log_threshold);
+        NodeRules::compile(Config::rules.empty() ? NodeRules::default_rules() : Config::rules);
+
+        if (in_daemon)
+            Backend::host(context);
+
+        NodesManager::init(pw_context_get_main_loop(context), in_daemon);
+
+        if (!ConfigWatcher::start(pw_context_get_main_loop(context), config_path, Pipetron::on_config_changed))
+            Logger::info({.phase = "config"}, "Not watching %s, config changes need a restart", config_path.c_str());
+
+        static const struct pw_registry_events registry_events = {
+            .version = PW_VERSION_REGISTRY_EVENTS,
+            .global = Pipetron::on_registry_global,
+            .global_remove = Pipetron::on_registry_global_remove,
+        };
+
+        // with several remotes one that isn't up yet doesn't hold up the others, it is retried in the background like
+        // a lost connection. later connection losses are always retried
+        bool retry = remotes.size() > 1;
+        for (const string &remote : remotes) {
+            session *current = new session(remote);
+            sessions.push_back(current);
+
+            if (!current->connection.start(context, &registry_events, current, Pipetron::on_daemon_lost,
+                                           Pipetron::on_registry_synced, in_daemon, retry))
+                return false;
+        }
+
+        if (remotes.size() > 1)
+            Logger::info({.phase = "startup"}, "Serving %zu PipeWire remotes", remotes.size());
+
+        return true;
+    }
+
+    // replicated streams and their shared connections live on the context's loop or the sync thread's, both are
+    // stopped here
+    static void stop() {
+        ConfigWatcher::stop();
+        NodesManager::cleanup();
+
+        for (session *current : sessions)
+            delete current;
+        sessions.clear();
+    }
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+// USDT probes for bpftrace and perf, compiled in by the usdt meson option, which needs sys/sdt.h from systemtap.
+// without it a probe and its arguments compile to nothing. every probe is listed in tools/pipetron-latency.bt
+#ifndef PIPETRON_USDT
+#define PIPETRON_USDT 0
+#endif
+
+#if PIPETRON_USDT
+#include <sys/sdt.h>
+
+#define PIPETRON_PROBE(name, ...) STAP_PROBEV(pipetron, name, __VA_ARGS__)
+#else
+#define PIPETRON_PROBE(name, ...)                                                                                      \
+    do {                                                                                                               \
+    } while (0)
+#endif
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "spa/param/audio/raw.h"
+#include "spa/param/props.h"
+#include "spa/pod/builder.h"
+#include "spa/pod/iter.h"
+#include "spa/utils/type.h"
+#include <cstdint>
+#include <cstring>
+
+/**
+compact copy of the Props fields pipetron syncs, so changes can be compared field by field instead of resending pods
+*/
+struct props_state {
+    enum field : uint32_t {
+        VOLUME = 1 << 0,
+        MUTE = 1 << 1,
+        CHANNEL_VOLUMES = 1 << 2,
+        CHANNEL_MAP = 1 << 3,
+        SOFT_VOLUMES = 1 << 4,
+    };
+
+    // fields forwarded to the onode, soft volumes are applied by the stream itself and channelMap is fixed by its
+    // format, so writing those would only fight the app
+    static constexpr uint32_t SYNCED_FIELDS = VOLUME | MUTE | CHANNEL_VOLUMES;
+
+    uint32_t fields;
+    float volume;
+    bool mute;
+    uint32_t n_channel_volumes;
+    float channel_volumes[SPA_AUDIO_MAX_CHANNELS];
+    uint32_t n_channel_map;
+    uint32_t channel_map[SPA_AUDIO_MAX_CHANNELS];
+    uint32_t n_soft_volumes;
+    float soft_volumes[SPA_AUDIO_MAX_CHANNELS];
+
+    props_state() {
+        this->fields = 0;
+        this->volume = 1.0f;
+        this->mute = false;
+        this->n_channel_volumes = 0;
+        this->n_channel_map = 0;
+        this->n_soft_volumes = 0;
+    }
+
+    static props_state parse(const struct spa_pod *param) {
+        props_state state;
+
+        if (!param || !spa_pod_is_object_type(param, SPA_TYPE_OBJECT_Props))
+            return state;
+
+        const struct spa_pod_object *object = (const struct spa_pod_object *)param;
+        struct spa_pod_prop *prop;
+
+        SPA_POD_OBJECT_FOREACH(object, prop) {
+            switch (prop->key) {
+            case SPA_PROP_volume:
+                if (spa_pod_get_float(&prop->value, &state.volume) >= 0)
+                    state.fields |= VOLUME;
+                break;
+            case SPA_PROP_mute:
+                if (spa_pod_get_bool(&prop->value, &state.mute) >= 0)
+                    state.fields |= MUTE;
+                break;
+            case SPA_PROP_channelVolumes:
+                state.n_channel_volumes =
+                    spa_pod_copy_array(&prop->value, SPA_TYPE_Float, state.channel_volumes, SPA_AUDIO_MAX_CHANNELS);
+                if (state.n_channel_volumes > 0)
+                    state.fields |= CHANNEL_VOLUMES;
+                break;
+            case SPA_PROP_channelMap:
+                state.n_channel_map =
+                    spa_pod_copy_array(&prop->value, SPA_TYPE_Id, state.channel_map, SPA_AUDIO_MAX_CHANNELS);
+                if (state.n_channel_map > 0)
+                    state.fields |= CHANNEL_MAP;
+                break;
+            case SPA_PROP_softVolumes:
+                state.n_soft_volumes =
+                    spa_pod_copy_array(&prop->value, SPA_TYPE_Float, state.soft_volumes, SPA_AUDIO_MAX_CHANNELS);
+                if (state.n_soft_volumes > 0)
+                    state.fields |= SOFT_VOLUMES;
+                break;
+            default:
+                break;
+            }
+        }
+
+        return state;
+    }
+
+    // fields set in this state that are missing or hold a different value in other
+    uint32_t diff(const props_state &other) const {
+        uint32_t changed = this->fields & ~other.fields;
+        uint32_t common = this->fields & other.fields;
+
+        if ((common & VOLUME) && this->volume != other.volume)
+            changed |= VOLUME;
+
+        if ((common & MUTE) && this->mute != other.mute)
+            changed |= MUTE;
+
+        if ((common & CHANNEL_VOLUMES) &&
+            (this->n_channel_volumes != other.n_channel_volumes ||
+             memcmp(this->channel_volumes, other.channel_volumes, this->n_channel_volumes * sizeof(float)) != 0))
+            changed |= CHANNEL_VOLUMES;
+
+        if ((common & CHANNEL_MAP) &&
+            (this->n_channel_map != other.n_channel_map ||
+             memcmp(this->channel_map, other.channel_map, this->n_channel_map * sizeof(uint32_t)) != 0))
+            changed |= CHANNEL_MAP;
+
+        if ((common & SOFT_VOLUMES) &&
+            (this->n_soft_volumes != other.n_soft_volumes ||
+             memcmp(this->soft_volumes, other.soft_volumes, this->n_soft_volumes * sizeof(float)) != 0))
+            changed |= SOFT_VOLUMES;
+
+        return changed;
+    }
+
+    // copies the given fields from other, fields other doesn't hold are left untouched
+    void merge(const props_state &other, uint32_t merge_fields) {
+        merge_fields &= other.fields;
+
+        if (merge_fields & VOLUME)
+            this->volume = other.volume;
+
+        if (merge_fields & MUTE)
+            this->mute = other.mute;
+
+        if (merge_fields & CHANNEL_VOLUMES) {
+            this->n_channel_volumes = other.n_channel_volumes;
+            memcpy(this->channel_volumes, other.channel_volumes, other.n_channel_volumes * sizeof(float));
+        }
+
+        if (merge_fields & CHANNEL_MAP) {
+            this->n_channel_map = other.n_channel_map;
+            memcpy(this->channel_map, other.channel_map, other.n_channel_map * sizeof(uint32_t));
+        }
+
+        if (merge_fields & SOFT_VOLUMES) {
+            this->n_soft_volumes = other.n_soft_volumes;
+            memcpy(this->soft_volumes, other.soft_volumes, other.n_soft_volumes * sizeof(float));
+        }
+
+        this->fields |= merge_fields;
+    }
+
+    // copy for a node with a different channel count, every channel gets the loudest source channel volume
+    props_state with_channels(uint32_t channels) const {
+        props_state remapped = *this;
+
+        if (!(this->fields & CHANNEL_VOLUMES) || channels == 0 || channels == this->n_channel_volumes ||
+            channels > SPA_AUDIO_MAX_CHANNELS)
+            return remapped;
+
+        float loudest = 0.0f;
+        for (uint32_t i = 0; i < this->n_channel_volumes; i++)
+            loudest = this->channel_volumes[i] > loudest ? this->channel_volumes[i] : loudest;
+
+        remapped.n_channel_volumes = channels;
+        for (uint32_t i = 0; i < channels; i++)
+            remapped.channel_volumes[i] = loudest;
+
+        return remapped;
+    }
+
+    // copy for the same node after its channel layout changed, channels present in both layouts keep their volume and
+    // new ones get the loudest old one. unpositioned layouts are matched by index
+    props_state remap_channels(const spa_audio_info_raw &from, const spa_audio_info_raw &to) const {
+        props_state remapped = *this;
+
+        if (!(this->fields & CHANNEL_VOLUMES) || to.channels == 0 || to.channels > SPA_AUDIO_MAX_CHANNELS)
+            return remapped;
+
+        bool positioned = !((from.flags | to.flags) & SPA_AUDIO_FLAG_UNPOSITIONED);
+        uint32_t known = SPA_MIN(from.channels, this->n_channel_volumes);
+
+        float loudest = 0.0f;
+        for (uint32_t i = 0; i < this->n_channel_volumes; i++)
+            loudest = this->channel_volumes[i] > loudest ? this->channel_volumes[i] : loudest;
+
+        remapped.n_channel_volumes = to.channels;
+        for (uint32_t i = 0; i < to.channels; i++) {
+            remapped.channel_volumes[i] = loudest;
+
+            for (uint32_t j = 0; j < known; j++) {
+                if (positioned ? from.position[j] == to.position[i] : i == j) {
+                    remapped.channel_volumes[i] = this->channel_volumes[j];
+                    break;
+                }
+            }
+        }
+
+        if (this->fields & CHANNEL_MAP) {
+            remapped.n_channel_map = to.channels;
+            memcpy(remapped.channel_map, to.position, to.channels * sizeof(uint32_t));
+        }
+
+        return remapped;
+    }
+
+    // builds a Props pod holding only the given fields, the pod lives in the builder's buffer
+    struct spa_pod *build(struct spa_pod_builder &builder, uint32_t build_fields) const {
+        struct spa_pod_frame frame;
+        build_fields &= this->fields;
+
+        spa_pod_builder_push_object(&builder, &frame, SPA_TYPE_OBJECT_Props, SPA_PARAM_Props);
+
+        if (build_fields & VOLUME) {
+            spa_pod_builder_prop(&builder, SPA_PROP_volume, 0);
+            spa_pod_builder_float(&builder, this->volume);
+        }
+
+        if (build_fields & MUTE) {
+            spa_pod_builder_prop(&builder, SPA_PROP_mute, 0);
+            spa_pod_builder_bool(&builder, this->mute);
+        }
+
+        if (build_fields & CHANNEL_VOLUMES) {
+            spa_pod_builder_prop(&builder, SPA_PROP_channelVolumes, 0);
+            spa_pod_builder_array(&builder, sizeof(float), SPA_TYPE_Float, this->n_channel_volumes,
+                                  this->channel_volumes);
+        }
+
+        if (build_fields & CHANNEL_MAP) {
+            spa_pod_builder_prop(&builder, SPA_PROP_channelMap, 0);
+            spa_pod_builder_array(&builder, sizeof(uint32_t), SPA_TYPE_Id, this->n_channel_map, this->channel_map);
+        }
+
+        if (build_fields & SOFT_VOLUMES) {
+            spa_pod_builder_prop(&builder, SPA_PROP_softVolumes, 0);
+            spa_pod_builder_array(&builder, sizeof(float), SPA_TYPE_Float, this->n_soft_volumes, this->soft_volumes);
+        }
+
+        return (struct spa_pod *)spa_pod_builder_pop(&builder, &frame);
+    }
+};
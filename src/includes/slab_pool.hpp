@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+using std::vector;
+
+/**
+fixed size objects carved out of slabs of SLAB_SIZE slots. freed slots go on an intrusive free list and are reused
+before a new slab is allocated, objects never move so pointers to them stay valid until they are destroyed
+*/
+template <typename T, uint32_t SLAB_SIZE = 32> class SlabPool {
+  private:
+    union slot {
+        slot *next_free;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    vector<slot *> slabs = {};
+    slot *free_list = nullptr;
+    uint32_t live = 0;
+
+    void grow() {
+        slot *slab = new slot[SLAB_SIZE];
+        this->slabs.push_back(slab);
+
+        for (uint32_t i = SLAB_SIZE; i > 0; i--) {
+            slab[i - 1].next_free = this->free_list;
+            this->free_list = &slab[i - 1];
+        }
+    }
+
+  public:
+    SlabPool() = default;
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    // every object must have been destroyed, the slabs are released as raw memory
+    ~SlabPool() {
+        for (slot *slab : this->slabs)
+            delete[] slab;
+    }
+
+    template <typename... Args> T *create(Args &&...args) {
+        if (!this->free_list)
+            this->grow();
+
+        slot *free_slot = this->free_list;
+        this->free_list = free_slot->next_free;
+        this->live++;
+
+        return new (free_slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *object) {
+        if (!object)
+            return;
+
+        object->~T();
+
+        slot *freed = (slot *)(void *)object;
+        freed->next_free = this->free_list;
+        this->free_list = freed;
+        this->live--;
+    }
+
+    uint32_t size() const {
+        return this->live;
+    }
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "logger.hpp"
+#include "pipewire/context.h"
+#include "pipewire/core.h"
+#include "pipewire/loop.h"
+#include "pipewire/proxy.h"
+#include "pipewire/thread-loop.h"
+#include "spa/utils/hook.h"
+#include <cerrno>
+#include <cstdint>
+
+/**
+optional second loop on its own thread for the Props path: the per app connections with their vnode streams, and a
+second daemon connection the onodes' Props proxies are bound through. discovery and the onode setup proxies stay on the
+main loop, so a registry burst or a slow app connect there doesn't hold up volume changes.
+
+node state is shared by both loops and guarded by the thread loop's lock, which pipewire holds while the thread
+dispatches. main loop entry points take it with a guard while they touch that state, but never across a bind or a
+connect: work that creates objects on the thread, like an app connection and its vnode stream or an onode's Props
+proxy, is posted to it through the loop's invoke queue instead. without the thread everything runs on the main loop,
+the guard does nothing and posted work runs right away
+*/
+class SyncLoop {
+  private:
+    inline static struct pw_thread_loop *thread_loop = nullptr;
+    inline static struct pw_context *context = nullptr;
+    inline static struct pw_core *core = nullptr;
+    inline static struct pw_registry *registry = nullptr;
+    inline static struct spa_hook core_listener = {};
+    // the main loop stands in for the thread when it isn't running
+    inline static struct pw_loop *main_loop = nullptr;
+
+    static void on_core_error(void *data, uint32_t id, int seq, int res, const char *message) {
+        // the main connection sees the same daemon go away and drives the reconnect
+        if (id == PW_ID_CORE && res == -EPIPE)
+            Logger::warning({.phase = "sync"}, "Lost sync connection to PipeWire");
+    }
+
+  public:
+    class guard {
+      public:
+        guard() {
+            if (thread_loop)
+                pw_thread_loop_lock(thread_loop);
+        }
+
+        ~guard() {
+            if (thread_loop)
+                pw_thread_loop_unlock(thread_loop);
+        }
+
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+    };
+
+    static bool start(struct pw_loop *loop, bool threaded) {
+        main_loop = loop;
+
+        if (!threaded)
+            return true;
+
+        thread_loop = pw_thread_loop_new("pipetron-sync", nullptr);
+        if (!thread_loop)
+            return false;
+
+        context = pw_context_new(pw_thread_loop_get_loop(thread_loop), nullptr, 0);
+        if (!context || pw_thread_loop_start(thread_loop) < 0) {
+            SyncLoop::stop();
+            return false;
+        }
+
+        Logger::info({.phase = "sync"}, "Props sync runs on its own thread");
+        return true;
+    }
+
+    // the thread must not be stopped while the guard is held
+    static void stop() {
+        if (!thread_loop)
+            return;
+
+        pw_thread_loop_stop(thread_loop);
+        SyncLoop::disconnect();
+
+        if (context) {
+            pw_context_destroy(context);
+            context = nullptr;
+        }
+
+        pw_thread_loop_destroy(thread_loop);
+        thread_loop = nullptr;
+    }
+
+    // runs func on the thread with the lock held, data is copied. never blocks the caller
+    static void post(spa_invoke_func_t func, const void *data, size_t size) {
+        if (!thread_loop) {
+            func(nullptr, false, 0, data, size, nullptr);
+            return;
+        }
+
+        pw_loop_invoke(pw_thread_loop_get_loop(thread_loop), func, SPA_ID_INVALID, data, size, false, nullptr);
+    }
+
+    // returns once everything posted so far has run, the caller must not hold the guard
+    static void drain() {
+        if (thread_loop)
+            pw_loop_invoke(pw_thread_loop_get_loop(thread_loop), nullptr, 0, nullptr, 0, true, nullptr);
+    }
+
+    static bool threaded() {
+        return thread_loop != nullptr;
+    }
+
+    static struct pw_loop *get_loop() {
+        return thread_loop ? pw_thread_loop_get_loop(thread_loop) : main_loop;
+    }
+
+    // registry of the sync connection, connected on first use after start or after the daemon was lost. nullptr
+    // without the thread, callers use the main registry then
+    static struct pw_registry *get_registry() {
+        if (!thread_loop || registry)
+            return registry;
+
+        core = pw_context_connect(context, nullptr, 0);
+        if (!core)
+            return nullptr;
+
+        static const struct pw_core_events core_events = {
+            .version = PW_VERSION_CORE_EVENTS,
+            .error = SyncLoop::on_core_error,
+        };
+
+        spa_zero(core_listener);
+        pw_core_add_listener(core, &core_listener, &core_events, nullptr);
+
+        registry = pw_core_get_registry(core, PW_VERSION_REGISTRY, 0);
+        return registry;
+    }
+
+    // drops the sync connection once every proxy bound through it is gone, the caller holds the guard
+    static void disconnect() {
+        if (!core)
+            return;
+
+        spa_hook_remove(&core_listener);
+        pw_proxy_destroy((struct pw_proxy *)registry);
+        registry = nullptr;
+        pw_core_disconnect(core);
+        core = nullptr;
+    }
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "props_state.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using std::string;
+
+/**
+last synced Props per remote, app name and media class, kept in a memory mapped file so a new stream can be set to the
+right volume before its replicated node exists. slots are written seqlock style with a checksum, a slot torn by a crash
+is simply treated as empty
+*/
+class VolumeCache {
+  private:
+    static constexpr uint32_t MAGIC = 0x50545643; // "PTVC"
+    static constexpr uint32_t VERSION = 2;
+    static constexpr uint32_t SLOT_COUNT = 256;
+    static constexpr uint32_t KEY_SIZE = 192;
+
+    struct slot {
+        // odd while the slot is being written
+        uint32_t sequence;
+        uint32_t checksum;
+        uint64_t last_used;
+        uint64_t key_hash;
+        char key[KEY_SIZE];
+        uint32_t fields;
+        float volume;
+        uint32_t mute;
+        uint32_t n_channel_volumes;
+        float channel_volumes[SPA_AUDIO_MAX_CHANNELS];
+    };
+
+    struct file_layout {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t padding;
+        uint64_t use_counter;
+        slot slots[SLOT_COUNT];
+    };
+
+    inline static file_layout *mapping = nullptr;
+
+    static uint32_t slot_checksum(const slot &entry) {
+        // FNV-1a over everything after the checksum field
+        const uint8_t *bytes = (const uint8_t *)&entry.last_used;
+        size_t size = sizeof(slot) - offsetof(slot, last_used);
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 16777619u;
+
+        return hash;
+    }
+
+    static bool slot_valid(const slot &entry) {
+        return entry.sequence != 0 && entry.sequence % 2 == 0 && entry.checksum == slot_checksum(entry);
+    }
+
+    static string key_of(const string &remote, const string &app_name, const string &media_class) {
+        return remote + "\n" + app_name + "\n" + media_class;
+    }
+
+    // slot holding the key, or the slot to reuse for it: a free or torn one, otherwise the least recently used
+    static slot *find_slot(const string &key, bool &found) {
+        uint64_t hash = std::hash<string>()(key);
+        slot *victim = nullptr;
+        found = false;
+
+        for (uint32_t probe = 0; probe < SLOT_COUNT; probe++) {
+            slot &entry = mapping->slots[(hash + probe) % SLOT_COUNT];
+
+            // slots are never cleared, so a never written one ends the probe chain
+            if (entry.sequence == 0)
+                return victim && !slot_valid(*victim) ? victim : &entry;
+
+            if (!slot_valid(entry)) {
+                if (!victim || slot_valid(*victim))
+                    victim = &entry;
+                continue;
+            }
+
+            if (entry.key_hash == hash && strncmp(entry.key, key.c_str(), KEY_SIZE) == 0) {
+                found = true;
+                return &entry;
+            }
+
+            if (!victim || (slot_valid(*victim) && entry.last_used < victim->last_used))
+                victim = &entry;
+        }
+
+        return victim;
+    }
+
+  public:
+    static string default_path() {
+        const char *state_home = getenv("XDG_STATE_HOME");
+        const char *home = getenv("HOME");
+
+        if (state_home && state_home[0] != '\0')
+            return string(state_home) + "/pipetron/volumes";
+
+        if (home && home[0] != '\0')
+            return string(home) + "/.local/state/pipetron/volumes";
+
+        return "";
+    }
+
+    static bool open(const string &path) {
+        if (path.empty())
+            return false;
+
+        string dir = path.substr(0, path.find_last_of('/'));
+        for (size_t slash = dir.find('/', 1); slash != string::npos; slash = dir.find('/', slash + 1))
+            mkdir(dir.substr(0, slash).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        struct stat file_stat;
+        bool fresh = fstat(fd, &file_stat) != 0 || file_stat.st_size != (off_t)sizeof(file_layout);
+        if (fresh && ftruncate(fd, sizeof(file_layout)) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        void *addr = mmap(nullptr, sizeof(file_layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (addr == MAP_FAILED)
+            return false;
+
+        mapping = (file_layout *)addr;
+
+        if (fresh || mapping->magic != MAGIC || mapping->version != VERSION || mapping->slot_count != SLOT_COUNT) {
+            memset(mapping, 0, sizeof(file_layout));
+            mapping->magic = MAGIC;
+            mapping->version = VERSION;
+            mapping->slot_count = SLOT_COUNT;
+        }
+
+        return true;
+    }
+
+    static void close() {
+        if (!mapping)
+            return;
+
+        msync(mapping, sizeof(file_layout), MS_SYNC);
+        munmap(mapping, sizeof(file_layout));
+        mapping = nullptr;
+    }
+
+    static bool lookup(const string &remote, const string &app_name, const string &media_class, props_state &props) {
+        if (!mapping)
+            return false;
+
+        bool found = false;
+        slot *entry = find_slot(key_of(remote, app_name, media_class), found);
+        if (!found)
+            return false;
+
+        props = props_state();
+        props.fields = entry->fields & props_state::SYNCED_FIELDS;
+        props.volume = entry->volume;
+        props.mute = entry->mute != 0;
+        props.n_channel_volumes = SPA_MIN(entry->n_channel_volumes, SPA_AUDIO_MAX_CHANNELS);
+        memcpy(props.channel_volumes, entry->channel_volumes, props.n_channel_volumes * sizeof(float));
+
+        return props.fields != 0;
+    }
+
+    static void store(const string &remote, const string &app_name, const string &media_class,
+                      const props_state &props) {
+        string key = key_of(remote, app_name, media_class);
+        uint32_t fields = props.fields & props_state::SYNCED_FIELDS;
+
+        if (!mapping || !fields || key.size() >= KEY_SIZE)
+            return;
+
+        bool found = false;
+        slot *entry = find_slot(key, found);
+        if (!entry)
+            return;
+
+        uint32_t sequence = (entry->sequence | 1) + (entry->sequence % 2 == 0 ? 0 : 2);
+        __atomic_store_n(&entry->sequence, sequence, __ATOMIC_RELEASE);
+
+        entry->last_used = ++mapping->use_counter;
+        entry->key_hash = std::hash<string>()(key);
+        memset(entry->key, 0, KEY_SIZE);
+        memcpy(entry->key, key.c_str(), key.size());
+        entry->fields = fields;
+        entry->volume = props.volume;
+        entry->mute = props.mute ? 1 : 0;
+        entry->n_channel_volumes = props.n_channel_volumes;
+        memcpy(entry->channel_volumes, props.channel_volumes, props.n_channel_volumes * sizeof(float));
+        entry->checksum = slot_checksum(*entry);
+
+        __atomic_store_n(&entry->sequence, sequence + 1, __ATOMIC_RELEASE);
+    }
+};
@@ -1,94 +1,74 @@
-#include "includes/nodes_manager.hpp"
+#include "includes/config.hpp"
+#include "includes/logger.hpp"
+#include "includes/pipetron.hpp"
 #include "pipewire/context.h"
-#include "pipewire/core.h"
-#include "pipewire/keys.h"
 #include "pipewire/main-loop.h"
-#include "pipewire/node.h"
 #include "pipewire/pipewire.h"
-#include "pipewire/proxy.h"
-#include "spa/utils/dict.h"
-#include "spa/utils/hook.h"
 #include <cerrno>
-#include <cstdint>
 #include <cstring>
-#include <iostream>
-#include <ostream>
-#include <spa/param/audio/format-utils.h>
+#include <glob.h>
 #include <string>
-using std::cout;
-using std::endl;
+#include <vector>
 using std::string;
+using std::vector;
 
 void raiseError(bool condition, string message, int status = 1) {
     if (condition) {
-        cout << "Error: " << message << endl;
+        Logger::error({}, "%s", message.c_str());
+        Logger::stop();
         exit(status);
     }
 }
 
-struct registry_event_global_data {
-    struct pw_main_loop *main_loop;
-    struct pw_registry *reg;
-};
+// the default socket of every session on the host, an absolute path is taken as is for the remote name
+vector<string> discover_remotes() {
+    vector<string> remotes = {};
+    glob_t found;
 
-static void reg_event_find_chromium_nodes(void *data, uint32_t id, uint32_t permissions, const char *type,
-                                          uint32_t version, const struct spa_dict *props) {
-
-    auto *reg_data = (struct registry_event_global_data *)data;
-
-    if (strcmp(type, PW_TYPE_INTERFACE_Node) == 0) {
-        for (uint32_t i = 0; i < props->n_items; i++) {
-
-            if (strcmp(props->items[i].key, PW_KEY_APP_NAME) != 0)
-                continue;
+    if (glob("/run/user/*/pipewire-0", 0, nullptr, &found) == 0) {
+        for (size_t i = 0; i < found.gl_pathc; i++)
+            remotes.push_back(found.gl_pathv[i]);
+    }
 
-            if (strcmp(props->items[i].value, "Chromium") == 0 ||
-                strcmp(props->items[i].value, "Chromium input") == 0) {
+    globfree(&found);
+    return remotes;
+}
 
-                NodesManager::process_new_node(reg_data->reg, pw_main_loop_get_loop(reg_data->main_loop), id, type);
-            }
+// pipetron [--discover] [remote...], without remotes the default one is served
+vector<string> parse_remotes(int argc, char **argv) {
+    vector<string> remotes = {};
 
-            break;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--discover") == 0) {
+            vector<string> found = discover_remotes();
+            remotes.insert(remotes.end(), found.begin(), found.end());
+            continue;
         }
+
+        remotes.push_back(argv[i]);
     }
+
+    return remotes.empty() ? vector<string>{""} : remotes;
 }
 
-int main() {
+int main(int argc, char **argv) {
     pw_init(nullptr, nullptr);
+    Logger::start();
 
     // getting context to connect to pipewire daemon
     struct pw_main_loop *loop = pw_main_loop_new(nullptr);
     struct pw_context *context = pw_context_new(pw_main_loop_get_loop(loop), nullptr, 0);
 
-    // connect context to daemon
-    struct pw_core *core = pw_context_connect(context, nullptr, 0);
-    raiseError(core == nullptr, string("failed to connect to pipewire daemon, ") + strerror(errno), errno);
-
-    struct pw_registry *registry = pw_core_get_registry(core, PW_VERSION_REGISTRY, 0);
-
-    struct spa_hook *listener = new spa_hook();
-
-    static const struct pw_registry_events registry_events = {
-        .version = PW_VERSION_REGISTRY_EVENTS,
-        .global = reg_event_find_chromium_nodes,
-        .global_remove = NodesManager::on_global_remove,
-    };
-
-    struct registry_event_global_data reg_data = {loop, registry};
-    pw_registry_add_listener(registry, listener, &registry_events, &reg_data);
+    bool connected = Pipetron::start(context, Config::default_path(), false, parse_remotes(argc, argv));
+    raiseError(!connected, string("failed to connect to pipewire daemon, ") + strerror(errno), errno);
 
     pw_main_loop_run(loop);
 
-    pw_proxy_destroy((struct pw_proxy *)registry);
-    pw_core_disconnect(core);
+    Pipetron::stop();
     pw_context_destroy(context);
     pw_main_loop_destroy(loop);
 
-    spa_hook_remove(listener);
-    delete listener;
-    listener = nullptr;
-
-    NodesManager::cleanup();
+    Logger::stop();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include "includes/config.hpp"
+#include "includes/logger.hpp"
+#include "includes/pipetron.hpp"
+#include "pipewire/context.h"
+#include "pipewire/impl-module.h"
+#include "pipewire/keys.h"
+#include "pipewire/log.h"
+#include "pipewire/properties.h"
+#include "spa/utils/defs.h"
+#include "spa/utils/dict.h"
+#include "spa/utils/hook.h"
+#include <cerrno>
+#include <cstring>
+#include <string>
+using std::string;
+
+// loaded into the pipewire daemon with, in pipewire.conf:
+//   context.modules = [ { name = libpipewire-module-pipetron args = { config.path = <file> } } ]
+
+PW_LOG_TOPIC_STATIC(pipetron_topic, "mod.pipetron");
+#define PW_LOG_TOPIC_DEFAULT pipetron_topic
+
+static struct spa_hook module_listener;
+
+static const struct spa_dict_item module_props[] = {
+    {PW_KEY_MODULE_DESCRIPTION, "Replicates Electron audio streams so volume controls show the app"},
+    {PW_KEY_MODULE_USAGE, "( config.path=<pipetron config file> )"},
+};
+
+// lines go to the daemon's own log, not to its stdout
+static void log_to_daemon(log_level level, const char *line) {
+    switch (level) {
+    case log_level::DEBUG:
+        pw_log_debug("%s", line);
+        break;
+    case log_level::INFO:
+        pw_log_info("%s", line);
+        break;
+    case log_level::WARNING:
+        pw_log_warn("%s", line);
+        break;
+    default:
+        pw_log_error("%s", line);
+    }
+}
+
+static void on_module_destroy(void *data) {
+    spa_hook_remove(&module_listener);
+
+    Pipetron::stop();
+    Logger::stop();
+}
+
+extern "C" SPA_EXPORT int pipewire__module_init(struct pw_impl_module *module, const char *args) {
+    struct pw_context *context = pw_impl_module_get_context(module);
+    PW_LOG_TOPIC_INIT(pipetron_topic);
+    Logger::start(log_to_daemon);
+
+    struct pw_properties *props = args ? pw_properties_new_string(args) : nullptr;
+    const char *config_path = props ? pw_properties_get(props, "config.path") : nullptr;
+    string path = config_path ? string(config_path) : Config::default_path();
+    if (props)
+        pw_properties_free(props);
+
+    if (!Pipetron::start(context, path, true)) {
+        int res = errno;
+        Logger::error({}, "failed to connect to the daemon from within, %s", strerror(res));
+
+        Pipetron::stop();
+        Logger::stop();
+        return -res;
+    }
+
+    static const struct pw_impl_module_events module_events = {
+        .version = PW_VERSION_IMPL_MODULE_EVENTS,
+        .destroy = on_module_destroy,
+    };
+
+    pw_impl_module_add_listener(module, &module_listener, &module_events, nullptr);
+    const struct spa_dict module_dict = SPA_DICT_INIT_ARRAY(module_props);
+    pw_impl_module_update_properties(module, &module_dict);
+
+    return 0;
+}
\ No newline at end of file